@@ -10,6 +10,7 @@
 #include "include/YamlUtils.h"
 #include "include/TreeManager.h"
 #include "include/EventMixer.h" 
+#include "include/BinScheduler.h"
 
 void MixedEventInterface(const char * configFileName) {
     
@@ -63,35 +64,20 @@ void MixedEventInterface(const char * configFileName) {
     }
     */
 
-    // Parallel
+    // Parallel: chunks are taken from a shared queue, most expensive first. Each worker fills the buffer of its chunk,
+    // the buffers are merged in bin order once all chunks are done
+    const int nMixingChunks = mixer.GetNChunks();
     int nThreads = mixer.GetNThreads();
-    nThreads = std::min(nThreads, nMixingBins);
+    nThreads = std::min(nThreads, nMixingChunks);
 
-    std::vector<std::future<void>> futures;
-
-    auto worker = [&] (int startBin, int endBin) {
-        for (int ibin = startBin; ibin < endBin; ibin++) {
-            mixer.BinMixing(ibin);
-        }
-    };
-
-    const int binPerThread = nMixingBins / nThreads;
-    int remainingBins = nMixingBins % nThreads;
-
-    int startBin = 0;
-    for (int ithread = 0; ithread < nThreads; ithread++) {
-        std::cout << "Thread: " << ithread << "/" << nThreads << std::endl;
-        int endBin = startBin + binPerThread + (remainingBins > 0 ? 1 : 0);
-        if (remainingBins > 0) {
-            --remainingBins;
-        }
-        futures.push_back(std::async(std::launch::async, worker, startBin, endBin));
-        startBin = endBin;
-    }
-    
-    for (auto & future : futures) {
-        future.get();
+    std::vector<double> chunkCosts(nMixingChunks);
+    for (int ichunk = 0; ichunk < nMixingChunks; ichunk++) {
+        chunkCosts[ichunk] = mixer.GetChunkCost(ichunk);
     }
+    BinScheduler scheduler(chunkCosts);
+    scheduler.Run(nThreads, [&] (int ichunk) { mixer.ChunkMixingBuffered(ichunk); });
+    scheduler.PrintUtilization();
+    mixer.MergeMixedBins();
 
     // Save the mixed tree
     std::cout << "Saving mixed tree to sample_data/mixed_trees.root"  << std::endl;
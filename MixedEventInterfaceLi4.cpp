@@ -3,93 +3,230 @@
 #include <string>
 #include <future>
 #include <algorithm>
+#include <functional>
+#include <memory>
 
 #include <TFile.h>
 #include <TTree.h>
 
 #include "include/TreeManager.h"
 #include "include/EventMixer.h" 
+#include "include/BinScheduler.h"
+#include "include/StageCache.h"
 
 void MixedEventInterfaceLi4(const char * configFileName) {
     
     std::cout << "MixedEventInterface" << std::endl;
 
     YAML::Node config = YAML::LoadFile(configFileName);
-    std::string inputTreeFile = config["InputTreeFile"].as<std::string>();
+    // a single file, a glob pattern or a list of them
+    const std::vector<std::string> inputTreeFiles = ExpandInputFiles(config["InputTreeFile"]);
     std::vector<std::string> treeNames;
     YamlUtils::ReadYamlVector(config["TreeNames"], treeNames);
-    std::string inputTreeMergeFile = config["InputTreeMergeFile"].as<std::string>();
-    std::string inputTreeHMergeFile = config["InputTreeHMergeFile"].as<std::string>();
+    std::string outputFileName = config["OutputFile"].as<std::string>();
+
+    // StageCaching: the merged files are reused when the content hash of their inputs (input files, merge and
+    // column dictionaries) is unchanged
+    const bool stageCaching = config["StageCaching"] ? config["StageCaching"].as<bool>() : false;
+    // SortedCacheFile: the sorted events of a previous run with the same inputs, columns, selection and binning
+    // are memory-mapped instead of being read and sorted again. Only written when given: it is a full uncompressed copy
+    const std::string sortedCacheFile = config["SortedCacheFile"] ? config["SortedCacheFile"].as<std::string>() : "";
+    const bool outOfCore = config["OutOfCore"] ? config["OutOfCore"].as<bool>() : false;
+    std::string inputFilesKey = DescribeInputFiles(inputTreeFiles) + " trees:";
+    for (const auto & treeName : treeNames) {
+        inputFilesKey += " " + treeName;
+    }
 
-    bool doMerge = config["DoMerge"].as<bool>();
-    if (doMerge) {
-        std::cout << "MergeAllTrees" << std::endl;
-        MergeAllTrees(inputTreeFile.c_str(), treeNames, inputTreeMergeFile.c_str());
+    // DirectIngest: the trees of the DF_ directories are joined in memory by the mixer, no merged file is written
+    const bool directIngest = config["DirectIngest"] ? config["DirectIngest"].as<bool>() : false;
+    std::string inputTreeMergeFile, inputTreeHMergeFile;
+    // JoinMode: "copy" writes the horizontally merged tree, "friends" attaches the merged trees as friends
+    const std::string joinMode = config["JoinMode"] ? config["JoinMode"].as<std::string>() : "copy";
+    if (joinMode != "copy" && joinMode != "friends") {
+        throw std::invalid_argument("Unknown JoinMode: " + joinMode);
+    }
+
+    // the sorted events depend on the files the mixer actually reads: the input files or one of the merged files
+    std::string inputKey;
+    if (directIngest) {
+        inputKey = inputFilesKey + " direct";
+    } else {
+        inputTreeMergeFile = config["InputTreeMergeFile"].as<std::string>();
+        inputTreeHMergeFile = config["InputTreeHMergeFile"].as<std::string>();
 
-        std::cout << std::endl;
         std::vector<std::vector<std::string>> columnDicts;
+        std::vector<std::string> mergeKeys = {"TreeNames"};
         for (const auto & treeName : treeNames) {
             std::vector<std::string> columnDict;
             YamlUtils::ReadYamlVector(config[treeName+"Dict"], columnDict);
             columnDicts.push_back(columnDict);
+            mergeKeys.push_back(treeName+"Dict");
+        }
+        const std::string mergeHash = StageCache::HashConfig(config, mergeKeys, inputFilesKey);
+        const std::string hMergeHash = StageCache::HashConfig(config, {"ColumnDict"}, mergeHash);
+
+        // the hash of a merged file is removed whenever the file is rewritten, and only recorded with StageCaching
+        bool doMerge = config["DoMerge"].as<bool>();
+        if (doMerge && stageCaching && StageCache::IsUpToDate(inputTreeMergeFile, mergeHash)) {
+            std::cout << "MergeAllTrees: " << inputTreeMergeFile << " is up to date" << std::endl;
+        } else if (doMerge) {
+            std::cout << "MergeAllTrees" << std::endl;
+            StageCache::Invalidate(inputTreeMergeFile);
+            ParallelMergeAllTrees(inputTreeFiles, treeNames, columnDicts, inputTreeMergeFile.c_str(), config["NThreads"].as<int>());
+            if (stageCaching) {
+                StageCache::Record(inputTreeMergeFile, mergeHash);
+            }
+        }
+        if (doMerge && joinMode == "copy" && stageCaching && StageCache::IsUpToDate(inputTreeHMergeFile, hMergeHash)) {
+            std::cout << "HorizontalMerge: " << inputTreeHMergeFile << " is up to date" << std::endl;
+        } else if (doMerge && joinMode == "copy") {
+            std::cout << std::endl;
+            std::vector<std::string> columnDictFull;
+            YamlUtils::ReadYamlVector(config["ColumnDict"], columnDictFull);
+
+            StageCache::Invalidate(inputTreeHMergeFile);
+            HorizontalMerge(inputTreeMergeFile.c_str(), treeNames, inputTreeHMergeFile.c_str(), 
+                            columnDicts, columnDictFull);
+            if (stageCaching) {
+                StageCache::Record(inputTreeHMergeFile, hMergeHash);
+            }
+        }
+
+        const std::string& joinFile = joinMode == "friends" ? inputTreeMergeFile : inputTreeHMergeFile;
+        inputKey = DescribeInputFiles({joinFile}) + " join: " + joinMode;
+        if (stageCaching) {
+            inputKey += " merge: " + (joinMode == "friends" ? mergeHash : hMergeHash);
         }
-        std::vector<std::string> columnDictFull;
-        YamlUtils::ReadYamlVector(config["ColumnDict"], columnDictFull);
+    }
 
-        HorizontalMerge(inputTreeMergeFile.c_str(), treeNames, inputTreeHMergeFile.c_str(), 
-                        columnDicts, columnDictFull);
+    std::unique_ptr<EventMixer> mixerPtr;
+    bool sortedFromCache = false;
+    if (!sortedCacheFile.empty() && !outOfCore) {
+        mixerPtr = std::make_unique<EventMixer>(configFileName);
+        sortedFromCache = mixerPtr->LoadSortedCache(sortedCacheFile, inputKey);
+        if (!sortedFromCache) {
+            mixerPtr.reset();
+        }
     }
-    TFile * inputHMergeFile = TFile::Open(inputTreeHMergeFile.c_str());
-    TTree * inputHMergeTree = (TTree *) inputHMergeFile->Get("outputTree");
 
-    EventMixer mixer(inputHMergeTree, configFileName);
-    inputHMergeFile->Close();
+    if (!mixerPtr && directIngest) {
+        std::cout << "Reading " << inputTreeFiles.size() << " input files directly" << std::endl;
+        mixerPtr = std::make_unique<EventMixer>(inputTreeFiles, treeNames, configFileName);
+    } else if (!mixerPtr) {
+        TFile * inputJoinFile = nullptr;
+        TTree * inputJoinTree = nullptr;
+        if (joinMode == "friends") {
+            std::cout << "Joining " << inputTreeMergeFile << " as friend trees" << std::endl;
+            inputJoinFile = TFile::Open(inputTreeMergeFile.c_str());
+            inputJoinTree = FriendJoin(inputJoinFile, treeNames);
+        } else {
+            inputJoinFile = TFile::Open(inputTreeHMergeFile.c_str());
+            inputJoinTree = (TTree *) inputJoinFile->Get("outputTree");
+        }
+
+        mixerPtr = std::make_unique<EventMixer>(inputJoinTree, configFileName);
+        inputJoinFile->Close();
+    }
+    EventMixer& mixer = *mixerPtr;
     mixer.Print();
-    mixer.Sorting();
+
+    const bool doParallel = config["DoParallel"].as<bool>();
+
+    // OutOfCore: the events are already partitioned by bin on disk, bins are mixed a few at a time (NThreads
+    // with DoParallel) and written as soon as they are mixed
+    if (mixer.IsOutOfCore()) {
+        std::cout << "Out-of-core mixing to " << outputFileName << std::endl;
+        TFile * outputFile = TFile::Open(outputFileName.c_str(), "RECREATE");
+        TTree * outputTree = new TTree("MixedTree", "MixedTree");
+        const long nEntries = mixer.OutOfCoreMixing(outputTree, doParallel ? mixer.GetNThreads() : 1);
+        std::cout << "Mixed entries written: " << nEntries << std::endl;
+        outputFile->cd();
+        outputTree->Write();
+        outputFile->Close();
+        return;
+    }
+
+    if (!sortedFromCache) {
+        mixer.Sorting();
+        if (!sortedCacheFile.empty()) {
+            mixer.WriteSortedCache(sortedCacheFile, inputKey);
+        }
+    }
 
     const int nMixingBins = mixer.GetNBins() - 1; // Exclude the overflow bin
     //const int nMixingBins = 1; // checking purpose
-    const bool doParallel = config["DoParallel"].as<bool>();
-    if (!doParallel) {
+    const int nMixingChunks = mixer.GetNChunks(); // bins split in chunks of at most ChunkSize events
+
+    // Streaming: mixed chunks are handed to a writer stage filling the output tree while other chunks are mixed
+    const bool doStreaming = config["DoStreaming"] ? config["DoStreaming"].as<bool>() : false;
+    TFile * outputFile = nullptr;
+    TTree * outputTree = nullptr;
+    std::unique_ptr<MixedTreeWriter> writer;
+    // workers fill per-chunk buffers, merged in bin order once all chunks are done
+    std::function<void(int)> mixChunk = [&] (int ichunk) { mixer.ChunkMixingBuffered(ichunk); };
+    if (doStreaming) {
+        std::cout << "Streaming mixed tree to " << outputFileName << std::endl;
+        outputFile = TFile::Open(outputFileName.c_str(), "RECREATE");
+        outputTree = new TTree("MixedTree", "MixedTree");
+        // at most 2 x NThreads mixed chunks wait for the writer
+        writer = std::make_unique<MixedTreeWriter>(outputTree, mixer.GetSortedArray(), mixer.GetSecondElementMask(), 
+                                                   nMixingChunks, mixer.GetMaxMixSize(), 2 * mixer.GetNThreads());
+        // chunks get what is left of MaxMixSize and are skipped once it is used up; a failing worker aborts the writer
+        mixChunk = [&] (int ichunk) {
+            if (!writer->WaitForSlot(ichunk)) {
+                return;
+            }
+            std::vector<MixedPair> mixedPairs;
+            try {
+                mixer.ChunkMixing(ichunk, mixedPairs);
+            } catch (...) {
+                writer->Abort();
+                throw;
+            }
+            writer->Push(ichunk, std::move(mixedPairs));
+        };
+    }
+
+    if (!doParallel && !doStreaming) {
         for (int ibin = 0; ibin < nMixingBins; ibin++) {
             std::cout << "BinMixing: " << ibin << "/" << nMixingBins << std::endl;
             mixer.BinMixing(ibin);
         }
+    } else if (!doParallel) {
+        for (int ichunk = 0; ichunk < nMixingChunks; ichunk++) {
+            mixChunk(ichunk);
+        }
     } else {
         int nThreads = mixer.GetNThreads();
-        nThreads = std::min(nThreads, nMixingBins);
-
-        std::vector<std::future<void>> futures;
-
-        auto worker = [&] (int startBin, int endBin) {
-            for (int ibin = startBin; ibin < endBin; ibin++) {
-                mixer.BinMixing(ibin);
-            }
-        };
+        nThreads = std::min(nThreads, nMixingChunks);
 
-        const int binPerThread = nMixingBins / nThreads;
-        int remainingBins = nMixingBins % nThreads;
-
-        int startBin = 0;
-        for (int ithread = 0; ithread < nThreads; ithread++) {
-            int endBin = startBin + binPerThread + (remainingBins > 0 ? 1 : 0);
-            if (remainingBins > 0) {
-                --remainingBins;
-            }
-            futures.push_back(std::async(std::launch::async, worker, startBin, endBin));
-            startBin = endBin;
-            std::cout << "Thread " << ithread << " / " << nThreads << " completed" << std::endl;
+        // chunks are taken from a shared queue, most expensive first. When streaming they are taken in bin order,
+        // the writer only writes the chunks in that order and holds back the workers running ahead
+        std::vector<double> chunkCosts(nMixingChunks);
+        for (int ichunk = 0; ichunk < nMixingChunks; ichunk++) {
+            chunkCosts[ichunk] = mixer.GetChunkCost(ichunk);
         }
+        BinScheduler scheduler(chunkCosts, doStreaming);
+        scheduler.Run(nThreads, mixChunk);
+        scheduler.PrintUtilization();
 
-        for (auto & future : futures) {
-            future.get();
+        if (!doStreaming) {
+            mixer.MergeMixedBins();
         }
     }
 
+    if (doStreaming) {
+        writer->Close();
+        std::cout << "Mixed entries written: " << writer->GetNEntries() << std::endl;
+        outputFile->cd();
+        outputTree->Write();
+        outputFile->Close();
+        return;
+    }
+
     // Save the mixed tree
-    std::string outputFileName = config["OutputFile"].as<std::string>();
     std::cout << "Saving mixed tree to " << outputFileName << std::endl;
-    TFile * outputFile = TFile::Open(outputFileName.c_str(), "RECREATE");
+    outputFile = TFile::Open(outputFileName.c_str(), "RECREATE");
     mixer.SaveMixedTree(outputFile, "MixedTree");
     outputFile->Close();
 }
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <functional>
+#include <algorithm>
+
+/**
+ * @brief Chunk of a mixing bin with its estimated cost
+ */
+struct ChunkTask
+{
+    int chunk;
+    double cost;                                    // estimated cost (number of events x buffer size)
+};
+
+/**
+ * @brief Dynamic scheduler for the chunks of the mixing bins.
+ * Chunks are kept in a shared queue ordered by decreasing estimated cost, idle workers take the next chunk from the queue.
+ * Expensive chunks start first and cheap ones fill the gaps, so threads finish at about the same time.
+ * With inOrder the chunks are taken in index (bin) order instead, for consumers that need them in that order,
+ * e.g. the streaming writer
+ */
+class BinScheduler
+{
+    public:
+        BinScheduler(const std::vector<double>& chunkCosts, const bool inOrder = false);
+
+        void Run(const int nThreads, const std::function<void(int)>& mixChunk);
+        void PrintUtilization() const;
+
+    private:
+        std::vector<ChunkTask> m_tasks;                 // chunks ordered by decreasing cost (or by index)
+        std::atomic<size_t> m_nextTask;                 // position of the next task in the shared queue
+
+        double m_wallTime;                              // duration of Run [s]
+        std::vector<double> m_busyTime;                 // time spent mixing by each thread [s]
+        std::vector<int> m_nTasks;                      // number of chunks mixed by each thread
+        std::vector<double> m_threadCost;               // estimated cost mixed by each thread
+};
+
+BinScheduler::BinScheduler(const std::vector<double>& chunkCosts, const bool inOrder): m_nextTask(0), m_wallTime(0.)
+{
+    m_tasks.reserve(chunkCosts.size());
+    for (size_t ichunk = 0; ichunk < chunkCosts.size(); ichunk++) {
+        m_tasks.push_back({static_cast<int>(ichunk), chunkCosts[ichunk]});
+    }
+    if (inOrder) {
+        return;
+    }
+    std::stable_sort(m_tasks.begin(), m_tasks.end(), [](const ChunkTask& a, const ChunkTask& b) {
+        return a.cost > b.cost;
+    });
+}
+
+/**
+ * @brief Mix all the chunks with nThreads workers taking chunks from the shared queue
+ * @param mixChunk Function mixing a single chunk, must be thread safe
+ */
+void BinScheduler::Run(const int nThreads, const std::function<void(int)>& mixChunk)
+{
+    m_nextTask = 0;
+    m_busyTime.assign(nThreads, 0.);
+    m_nTasks.assign(nThreads, 0);
+    m_threadCost.assign(nThreads, 0.);
+
+    auto worker = [&] (int ithread) {
+        for (size_t itask = m_nextTask++; itask < m_tasks.size(); itask = m_nextTask++) {
+            auto start = std::chrono::steady_clock::now();
+            mixChunk(m_tasks[itask].chunk);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            m_busyTime[ithread] += elapsed.count();
+            m_nTasks[ithread]++;
+            m_threadCost[ithread] += m_tasks[itask].cost;
+        }
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::future<void>> futures;
+    for (int ithread = 0; ithread < nThreads; ithread++) {
+        futures.push_back(std::async(std::launch::async, worker, ithread));
+    }
+    for (auto & future : futures) {
+        future.get();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    m_wallTime = elapsed.count();
+}
+
+void BinScheduler::PrintUtilization() const
+{
+    std::cout << "----------------------------------------" << std::endl;
+    std::cout << "\t\tBinScheduler" << std::endl;
+    std::cout << "----------------------------------------" << std::endl;
+    std::cout << "Wall time: " << m_wallTime << " s" << std::endl;
+    for (size_t ithread = 0; ithread < m_busyTime.size(); ithread++) {
+        const double utilization = m_wallTime > 0. ? 100. * m_busyTime[ithread] / m_wallTime : 0.;
+        std::cout << "Thread " << ithread << ": " << m_nTasks[ithread] << " chunks, estimated cost " << m_threadCost[ithread]
+                  << ", busy " << m_busyTime[ithread] << " s (" << static_cast<int>(utilization + 0.5) << "%)" << std::endl;
+    }
+    std::cout << "----------------------------------------" << std::endl;
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <stdexcept>
+
+#include <unistd.h>
+
+#include "ColumnStore.h"
+
+/**
+ * @brief Events partitioned by mixing bin in spill files on local disk, for datasets larger than the memory.
+ * Rows are buffered per bin and appended to the file of the bin as columnar blocks (see ColumnStore::WriteBlock)
+ * once the buffers exceed the memory budget. Rows keep the order in which they are added.
+ * The files are removed by the destructor
+ */
+class BinSpill
+{
+    public:
+        BinSpill(const ColumnStore& schema, const int nBins, const std::string& directory, const size_t maxBufferedBytes);
+        BinSpill(const BinSpill& other) = delete;
+        BinSpill& operator=(const BinSpill& other) = delete;
+        ~BinSpill();
+
+        int GetNBins() const { return (int)m_binSizes.size(); }
+        long GetBinSize(const int ibin) const { return m_binSizes[ibin]; }
+        void Add(const ColumnStore& store, const int* bins);
+        void Flush();
+        void ReadBin(const int ibin, ColumnStore& store) const;
+
+    private:
+        std::string GetFileName(const int ibin) const;
+        void Flush(const int ibin);
+
+        std::vector<ColumnStore> m_buffers;             // rows of each bin not yet written
+        std::vector<long> m_binSizes;                   // rows of each bin, written or buffered
+        std::vector<bool> m_binWritten;                 // the file of the bin exists
+        std::string m_filePrefix;
+        size_t m_rowSize;                               // bytes of a row
+        size_t m_bufferedRows = 0;
+        size_t m_maxBufferedRows;
+};
+
+BinSpill::BinSpill(const ColumnStore& schema, const int nBins, const std::string& directory, const size_t maxBufferedBytes):
+    m_buffers(nBins, schema), m_binSizes(nBins, 0), m_binWritten(nBins, false)
+{
+    for (auto& buffer: m_buffers) {
+        buffer.Clear();
+    }
+    m_filePrefix = directory + "/mixing_spill_" + std::to_string(getpid()) + "_bin";
+    m_rowSize = std::max<size_t>(1, schema.GetRowSize());
+    m_maxBufferedRows = std::max<size_t>(1, maxBufferedBytes / m_rowSize);
+}
+
+BinSpill::~BinSpill()
+{
+    for (int ibin = 0; ibin < GetNBins(); ibin++) {
+        if (m_binWritten[ibin]) {
+            std::remove(GetFileName(ibin).c_str());
+        }
+    }
+}
+
+std::string BinSpill::GetFileName(const int ibin) const
+{
+    return m_filePrefix + std::to_string(ibin) + ".bin";
+}
+
+/**
+ * @brief Add the rows of a store with the same schema
+ * @param bins Bin of each row of the store
+ */
+void BinSpill::Add(const ColumnStore& store, const int* bins)
+{
+    for (size_t irow = 0; irow < store.GetSize(); irow++) {
+        m_buffers[bins[irow]].PushBack(store, irow);
+        m_binSizes[bins[irow]]++;
+    }
+    m_bufferedRows += store.GetSize();
+    if (m_bufferedRows > m_maxBufferedRows) {
+        Flush();
+    }
+}
+
+/**
+ * @brief Write all the buffered rows
+ */
+void BinSpill::Flush()
+{
+    for (int ibin = 0; ibin < GetNBins(); ibin++) {
+        Flush(ibin);
+    }
+    m_bufferedRows = 0;
+}
+
+void BinSpill::Flush(const int ibin)
+{
+    ColumnStore& buffer = m_buffers[ibin];
+    if (buffer.GetSize() == 0) {
+        return;
+    }
+    std::ofstream out(GetFileName(ibin), std::ios::binary | std::ios::app);
+    buffer.WriteBlock(out);
+    if (!out) {
+        throw std::runtime_error("BinSpill: cannot write " + GetFileName(ibin));
+    }
+    m_binWritten[ibin] = true;
+    buffer.Clear();
+}
+
+/**
+ * @brief Append the rows of a bin to a store with the same schema, decoding the blocks straight from the file.
+ * Only reads the file: can run in the background (e.g. to read the next bins) once all the rows are flushed
+ */
+void BinSpill::ReadBin(const int ibin, ColumnStore& store) const
+{
+    if (!m_binWritten[ibin]) {
+        return;
+    }
+    std::ifstream in(GetFileName(ibin), std::ios::binary);
+    if (!in.is_open()) {
+        throw std::runtime_error("BinSpill: cannot open " + GetFileName(ibin));
+    }
+    const size_t nRows = store.GetSize();
+    while (store.ReadBlock(in)) {}
+    if (store.GetSize() - nRows != static_cast<size_t>(m_binSizes[ibin])) {
+        throw std::runtime_error("BinSpill: truncated file " + GetFileName(ibin));
+    }
+}
@@ -0,0 +1,633 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+
+#include <TTree.h>
+
+/**
+ * @brief Contiguous storage of a single column. The values are kept as raw bytes,
+ * the type is identified by the ROOT leaf type code (F, I, b, ...)
+ */
+struct Column
+{
+    std::string name;
+    char type;                                      // ROOT leaf type code
+    size_t elementSize;                             // size in bytes of a single value
+    std::vector<char> data;                         // contiguous values, data.size() = elementSize * nRows
+    bool derived = false;                           // computed from other columns, not read from or written to trees
+};
+
+/**
+ * @brief ROOT leaf type code of a C++ type, used to check typed column handles
+ */
+template <typename T> constexpr char GetLeafType();
+template <> constexpr char GetLeafType<Char_t>() { return 'B'; }
+template <> constexpr char GetLeafType<UChar_t>() { return 'b'; }
+template <> constexpr char GetLeafType<Short_t>() { return 'S'; }
+template <> constexpr char GetLeafType<UShort_t>() { return 's'; }
+template <> constexpr char GetLeafType<Int_t>() { return 'I'; }
+template <> constexpr char GetLeafType<UInt_t>() { return 'i'; }
+template <> constexpr char GetLeafType<Float_t>() { return 'F'; }
+template <> constexpr char GetLeafType<Double_t>() { return 'D'; }
+template <> constexpr char GetLeafType<Long64_t>() { return 'L'; }
+template <> constexpr char GetLeafType<ULong64_t>() { return 'l'; }
+template <> constexpr char GetLeafType<Long_t>() { return 'G'; }
+template <> constexpr char GetLeafType<ULong_t>() { return 'g'; }
+template <> constexpr char GetLeafType<bool>() { return 'O'; }
+
+class ColumnStore;
+
+/**
+ * @brief Lightweight view of a row of a ColumnStore (a pointer to the store and an index)
+ */
+class RowView
+{
+    public:
+        RowView() = default;
+        RowView(const ColumnStore* store, size_t index): m_store(store), m_index(index) {}
+
+        size_t GetIndex() const { return m_index; }
+        float GetFloat(const int icolumn) const;
+        float GetFloat(const std::string& key) const;
+        void Print() const;
+
+    private:
+        const ColumnStore* m_store = nullptr;
+        size_t m_index = 0;
+};
+
+/**
+ * @brief Columnar event store: one typed contiguous array per column of the dictionary.
+ * A staging row (one value per column) is used as branch buffer to read from and write to TTrees.
+ * NOTE: branch addresses point to the staging row, do not copy the store after binding it to a tree
+ */
+class ColumnStore
+{
+    public:
+        ColumnStore() = default;
+        ColumnStore(const std::vector<std::string>& dictionary) { InitFromDict(dictionary); }
+
+        void InitFromDict(const std::vector<std::string>& dictionary);
+        int AddDerivedColumn(const std::string& name, const char type);
+
+        size_t GetSize() const { return m_size; }
+        int GetNColumns() const { return (int)m_columns.size(); }
+        bool HasColumn(const std::string& name) const { return m_columnIndex.find(name) != m_columnIndex.end(); }
+        int GetColumnIndex(const std::string& name) const;
+        const Column& GetColumn(const int icolumn) const { return m_columns[icolumn]; }
+        std::vector<std::string> GetColumnNames() const;
+
+        /**
+         * @brief Resolve a column name to an integer handle, checking that the column holds values of type T.
+         * Handles are positions in the dictionary, hence valid for every store built from the same dictionary
+         */
+        template <typename T>
+        int GetColumnHandle(const std::string& name) const
+        {
+            const int icolumn = GetColumnIndex(name);
+            if (m_columns[icolumn].type != GetLeafType<T>()) {
+                throw std::runtime_error("Column " + name + " has type " + m_columns[icolumn].type + ", requested " + GetLeafType<T>());
+            }
+            return icolumn;
+        }
+
+        /**
+         * @brief Typed pointer to the contiguous values of a column. The caller is responsible for the type
+         */
+        template <typename T>
+        const T* GetData(const int icolumn) const { return reinterpret_cast<const T*>(m_columns[icolumn].data.data()); }
+        template <typename T>
+        T* GetData(const int icolumn) { return reinterpret_cast<T*>(m_columns[icolumn].data.data()); }
+        float GetFloat(const int icolumn, const size_t index) const { return FloatCast(m_columns[icolumn], m_columns[icolumn].data.data() + index * m_columns[icolumn].elementSize); }
+        void GetFloats(const int icolumn, const size_t first, const size_t n, float* out) const;
+        bool IsEqual(const int icolumn, const size_t first, const size_t second) const;
+        RowView GetRow(const size_t index) const { return RowView(this, index); }
+        RowView operator[](const size_t index) const { return RowView(this, index); }
+
+        void Reserve(const size_t size);
+        void Clear();
+
+        void SetBranchAddresses(TTree* tree);
+        void SetBranchAddresses(TTree* tree, std::vector<bool>& bound);
+        void CreateBranches(TTree* tree);
+        float GetStagedFloat(const int icolumn) const { return FloatCast(m_columns[icolumn], m_staging.data() + m_stagingOffset[icolumn]); }
+        void PushStaged();
+        void LoadStaged(const size_t index);
+        void LoadStaged(const size_t first, const size_t second, const std::vector<bool>& secondMask);
+
+        void PushBack(const ColumnStore& other, const size_t index);
+        void Append(const ColumnStore& other);
+        void PushBackMixed(const ColumnStore& other, const size_t first, const size_t second, const std::vector<bool>& secondMask);
+        ColumnStore Gather(const std::vector<int>& indices) const;
+        void Filter(const std::vector<char>& mask);
+        void Permute(const std::vector<int>& indices);
+        void PermuteColumn(const int icolumn, const std::vector<int>& indices);
+        size_t GetRowSize() const;
+        void Assign(const std::vector<const char*>& columns, const size_t nRows);
+        void WriteBlock(std::ostream& out) const;
+        bool ReadBlock(std::istream& in);
+
+    protected:
+        template <typename T>
+        static void ConvertToFloat(const char* data, const size_t n, float* out);
+        template <typename T>
+        static void PermuteValues(T* values, const std::vector<int>& indices);
+        static size_t GetTypeSize(const char type);
+        static float FloatCast(const Column& column, const char* address);
+
+    private:
+        std::vector<Column> m_columns;
+        std::map<std::string, int> m_columnIndex;       // column name -> position in m_columns
+        std::vector<char> m_staging;                    // one value per column, used as branch buffer
+        std::vector<size_t> m_stagingOffset;            // offset of each column in the staging row
+        size_t m_size = 0;                              // number of rows
+};
+
+/**
+ * Initialize the columns from a dictionary-like vector
+ * NOTE: The dictionary should be in the format "branchName/type"
+ */
+void ColumnStore::InitFromDict(const std::vector<std::string>& dictionary)
+{
+    m_columns.clear();
+    m_columnIndex.clear();
+    m_stagingOffset.clear();
+    m_size = 0;
+
+    size_t stagingSize = 0;
+    for (const auto& line : dictionary) {
+        std::stringstream ss(line);
+        std::string key, value;
+        char delim = '/';
+
+        std::getline(ss, key, delim);
+        std::getline(ss, value, delim);
+
+        if (value.size() != 1) {
+            throw std::invalid_argument("Invalid type: " + value);
+        }
+
+        Column column;
+        column.name = key;
+        column.type = value[0];
+        column.elementSize = GetTypeSize(column.type);
+        m_columnIndex[key] = (int)m_columns.size();
+        m_columns.push_back(column);
+
+        m_stagingOffset.push_back(stagingSize);
+        stagingSize += sizeof(Long64_t); // keep every staged value aligned
+    }
+    m_staging.assign(stagingSize, 0);
+}
+
+/**
+ * @brief Add a column computed from the other ones. Derived columns follow the rows in all the operations on the store,
+ * but are neither read from nor written to trees. The values of the existing rows are zero-initialized
+ * NOTE: add derived columns before binding the store to a tree, the staging row is reallocated
+ */
+int ColumnStore::AddDerivedColumn(const std::string& name, const char type)
+{
+    Column column;
+    column.name = name;
+    column.type = type;
+    column.elementSize = GetTypeSize(type);
+    column.data.assign(m_size * column.elementSize, 0);
+    column.derived = true;
+    m_columnIndex[name] = (int)m_columns.size();
+    m_columns.push_back(column);
+
+    m_stagingOffset.push_back(m_staging.size());
+    m_staging.resize(m_staging.size() + sizeof(Long64_t), 0);
+    return (int)m_columns.size() - 1;
+}
+
+int ColumnStore::GetColumnIndex(const std::string& name) const
+{
+    auto it = m_columnIndex.find(name);
+    if (it == m_columnIndex.end()) {
+        throw std::runtime_error("Column not found in store: " + name);
+    }
+    return it->second;
+}
+
+std::vector<std::string> ColumnStore::GetColumnNames() const
+{
+    std::vector<std::string> columnNames;
+    for (const auto& column : m_columns) {
+        columnNames.push_back(column.name);
+    }
+    return columnNames;
+}
+
+/**
+ * @brief Convert n consecutive values of a column, starting from row first, to floats.
+ * The type is dispatched once per call, the conversion is a plain loop over the values
+ */
+void ColumnStore::GetFloats(const int icolumn, const size_t first, const size_t n, float* out) const
+{
+    const Column& column = m_columns[icolumn];
+    const char* data = column.data.data() + first * column.elementSize;
+    switch (column.type) {
+        case 'B': ConvertToFloat<Char_t>(data, n, out); break;
+        case 'b': ConvertToFloat<UChar_t>(data, n, out); break;
+        case 'S': ConvertToFloat<Short_t>(data, n, out); break;
+        case 's': ConvertToFloat<UShort_t>(data, n, out); break;
+        case 'I': ConvertToFloat<Int_t>(data, n, out); break;
+        case 'i': ConvertToFloat<UInt_t>(data, n, out); break;
+        case 'F': std::memcpy(out, data, n * sizeof(float)); break;
+        case 'D': ConvertToFloat<Double_t>(data, n, out); break;
+        case 'L': ConvertToFloat<Long64_t>(data, n, out); break;
+        case 'l': ConvertToFloat<ULong64_t>(data, n, out); break;
+        case 'G': ConvertToFloat<Long_t>(data, n, out); break;
+        case 'g': ConvertToFloat<ULong_t>(data, n, out); break;
+        case 'O': ConvertToFloat<bool>(data, n, out); break;
+        default: throw std::runtime_error("Non-arithmetic type in column: " + column.name);
+    }
+}
+
+template <typename T>
+void ColumnStore::ConvertToFloat(const char* data, const size_t n, float* out)
+{
+    for (size_t i = 0; i < n; i++) {
+        T value;
+        std::memcpy(&value, data + i * sizeof(T), sizeof(T));
+        out[i] = static_cast<float>(value);
+    }
+}
+
+bool ColumnStore::IsEqual(const int icolumn, const size_t first, const size_t second) const
+{
+    const Column& column = m_columns[icolumn];
+    return std::memcmp(column.data.data() + first * column.elementSize, column.data.data() + second * column.elementSize, column.elementSize) == 0;
+}
+
+void ColumnStore::Reserve(const size_t size)
+{
+    for (auto& column : m_columns) {
+        column.data.reserve(size * column.elementSize);
+    }
+}
+
+/**
+ * @brief Remove all the rows and release the memory
+ */
+void ColumnStore::Clear()
+{
+    for (auto& column : m_columns) {
+        std::vector<char>().swap(column.data);
+    }
+    m_size = 0;
+}
+
+/**
+ * Set branch addresses of a TTree to the staging row
+ * NOTE: SetBranchAddress READS from the tree
+ */
+void ColumnStore::SetBranchAddresses(TTree* tree)
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        if (m_columns[icolumn].derived) {
+            continue;
+        }
+        tree->SetBranchAddress(m_columns[icolumn].name.c_str(), m_staging.data() + m_stagingOffset[icolumn]);
+    }
+}
+
+/**
+ * Set branch addresses of the columns found in a TTree and flag them in bound.
+ * Used to join in the staging row several trees with the same entries, each providing part of the columns
+ */
+void ColumnStore::SetBranchAddresses(TTree* tree, std::vector<bool>& bound)
+{
+    bound.resize(m_columns.size(), false);
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        if (m_columns[icolumn].derived || !tree->GetBranch(m_columns[icolumn].name.c_str())) {
+            continue;
+        }
+        tree->SetBranchAddress(m_columns[icolumn].name.c_str(), m_staging.data() + m_stagingOffset[icolumn]);
+        bound[icolumn] = true;
+    }
+}
+
+/**
+ * Create branches of a TTree pointing to the staging row
+ * NOTE: Branch WRITES to the tree
+ */
+void ColumnStore::CreateBranches(TTree* tree)
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        const Column& column = m_columns[icolumn];
+        if (column.derived) {
+            continue;
+        }
+        tree->Branch(column.name.c_str(), m_staging.data() + m_stagingOffset[icolumn], (column.name + "/" + column.type).c_str());
+    }
+}
+
+/**
+ * @brief Append the staging row to the store
+ */
+void ColumnStore::PushStaged()
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        Column& column = m_columns[icolumn];
+        const char* address = m_staging.data() + m_stagingOffset[icolumn];
+        column.data.insert(column.data.end(), address, address + column.elementSize);
+    }
+    m_size++;
+}
+
+/**
+ * @brief Copy a row of the store to the staging row
+ */
+void ColumnStore::LoadStaged(const size_t index)
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        const Column& column = m_columns[icolumn];
+        std::memcpy(m_staging.data() + m_stagingOffset[icolumn], column.data.data() + index * column.elementSize, column.elementSize);
+    }
+}
+
+/**
+ * @brief Copy a mixed row to the staging row: columns flagged in secondMask are taken from the second row, all the others from the first
+ */
+void ColumnStore::LoadStaged(const size_t first, const size_t second, const std::vector<bool>& secondMask)
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        const Column& column = m_columns[icolumn];
+        const size_t index = secondMask[icolumn] ? second : first;
+        std::memcpy(m_staging.data() + m_stagingOffset[icolumn], column.data.data() + index * column.elementSize, column.elementSize);
+    }
+}
+
+/**
+ * @brief Append a row of another store with the same schema
+ */
+void ColumnStore::PushBack(const ColumnStore& other, const size_t index)
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        const Column& otherColumn = other.m_columns[icolumn];
+        const char* address = otherColumn.data.data() + index * otherColumn.elementSize;
+        m_columns[icolumn].data.insert(m_columns[icolumn].data.end(), address, address + otherColumn.elementSize);
+    }
+    m_size++;
+}
+
+/**
+ * @brief Bytes of the values of a row (staging excluded)
+ */
+size_t ColumnStore::GetRowSize() const
+{
+    size_t rowSize = 0;
+    for (const auto& column : m_columns) {
+        rowSize += column.elementSize;
+    }
+    return rowSize;
+}
+
+/**
+ * @brief Replace the rows with nRows values of each column, copied from contiguous arrays (e.g. a memory-mapped file)
+ */
+void ColumnStore::Assign(const std::vector<const char*>& columns, const size_t nRows)
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        Column& column = m_columns[icolumn];
+        column.data.assign(columns[icolumn], columns[icolumn] + nRows * column.elementSize);
+    }
+    m_size = nRows;
+}
+
+/**
+ * @brief Write all the rows as a block in a compact binary layout: the number of rows, then the values of each column
+ */
+void ColumnStore::WriteBlock(std::ostream& out) const
+{
+    const uint64_t nRows = m_size;
+    out.write(reinterpret_cast<const char*>(&nRows), sizeof(nRows));
+    for (const auto& column : m_columns) {
+        out.write(column.data.data(), m_size * column.elementSize);
+    }
+}
+
+/**
+ * @brief Append the rows of a block written by WriteBlock from a store with the same schema
+ * @return false if the stream has no more blocks
+ */
+bool ColumnStore::ReadBlock(std::istream& in)
+{
+    uint64_t nRows;
+    if (!in.read(reinterpret_cast<char*>(&nRows), sizeof(nRows))) {
+        return false;
+    }
+    for (auto& column : m_columns) {
+        const size_t offset = m_size * column.elementSize;
+        column.data.resize(offset + nRows * column.elementSize);
+        if (!in.read(column.data.data() + offset, nRows * column.elementSize)) {
+            throw std::runtime_error("ColumnStore: truncated block");
+        }
+    }
+    m_size += nRows;
+    return true;
+}
+
+/**
+ * @brief Append all the rows of another store with the same schema
+ */
+void ColumnStore::Append(const ColumnStore& other)
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        const std::vector<char>& otherData = other.m_columns[icolumn].data;
+        m_columns[icolumn].data.insert(m_columns[icolumn].data.end(), otherData.begin(), otherData.end());
+    }
+    m_size += other.m_size;
+}
+
+/**
+ * @brief Append a mixed row: columns flagged in secondMask are taken from the second row, all the others from the first
+ */
+void ColumnStore::PushBackMixed(const ColumnStore& other, const size_t first, const size_t second, const std::vector<bool>& secondMask)
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        const Column& otherColumn = other.m_columns[icolumn];
+        const size_t index = secondMask[icolumn] ? second : first;
+        const char* address = otherColumn.data.data() + index * otherColumn.elementSize;
+        m_columns[icolumn].data.insert(m_columns[icolumn].data.end(), address, address + otherColumn.elementSize);
+    }
+    m_size++;
+}
+
+/**
+ * @brief Create a new store with the rows at the given indices (in the given order)
+ */
+ColumnStore ColumnStore::Gather(const std::vector<int>& indices) const
+{
+    ColumnStore gathered;
+    gathered.m_columns.reserve(m_columns.size());
+    for (const auto& column : m_columns) {
+        Column gatheredColumn;
+        gatheredColumn.name = column.name;
+        gatheredColumn.type = column.type;
+        gatheredColumn.elementSize = column.elementSize;
+        gatheredColumn.derived = column.derived;
+        gatheredColumn.data.resize(indices.size() * column.elementSize);
+
+        char* destination = gatheredColumn.data.data();
+        const char* source = column.data.data();
+        for (size_t irow = 0; irow < indices.size(); irow++) {
+            std::memcpy(destination + irow * column.elementSize, source + indices[irow] * column.elementSize, column.elementSize);
+        }
+        gathered.m_columns.push_back(std::move(gatheredColumn));
+    }
+    gathered.m_columnIndex = m_columnIndex;
+    gathered.m_stagingOffset = m_stagingOffset;
+    gathered.m_staging.assign(m_staging.size(), 0);
+    gathered.m_size = indices.size();
+    return gathered;
+}
+
+/**
+ * @brief Keep only the rows with a non-zero mask, in place and preserving the order
+ */
+void ColumnStore::Filter(const std::vector<char>& mask)
+{
+    for (auto& column : m_columns) {
+        char* data = column.data.data();
+        size_t nKept = 0;
+        for (size_t irow = 0; irow < m_size; irow++) {
+            if (mask[irow]) {
+                if (nKept != irow) {
+                    std::memcpy(data + nKept * column.elementSize, data + irow * column.elementSize, column.elementSize);
+                }
+                nKept++;
+            }
+        }
+        column.data.resize(nKept * column.elementSize);
+    }
+    m_size = std::count_if(mask.begin(), mask.begin() + m_size, [](char selected) { return selected != 0; });
+}
+
+/**
+ * @brief Reorder the rows in place, row i taking the values of row indices[i]. Same result as Gather(indices)
+ * without a second copy of the store
+ * @param indices Permutation of [0, GetSize())
+ */
+void ColumnStore::Permute(const std::vector<int>& indices)
+{
+    for (size_t icolumn = 0; icolumn < m_columns.size(); icolumn++) {
+        PermuteColumn(icolumn, indices);
+    }
+}
+
+/**
+ * @brief Reorder a single column in place (see Permute). Different columns can be permuted concurrently
+ */
+void ColumnStore::PermuteColumn(const int icolumn, const std::vector<int>& indices)
+{
+    Column& column = m_columns[icolumn];
+    switch (column.elementSize) {
+        case 1: PermuteValues(reinterpret_cast<uint8_t*>(column.data.data()), indices); break;
+        case 2: PermuteValues(reinterpret_cast<uint16_t*>(column.data.data()), indices); break;
+        case 4: PermuteValues(reinterpret_cast<uint32_t*>(column.data.data()), indices); break;
+        case 8: PermuteValues(reinterpret_cast<uint64_t*>(column.data.data()), indices); break;
+        default: throw std::runtime_error("Unsupported element size in column: " + column.name);
+    }
+}
+
+/**
+ * @brief Apply the permutation following its cycles: the first value of a cycle is saved, then each position
+ * takes the value of its source until the cycle closes. The only extra memory is one bit per row
+ */
+template <typename T>
+void ColumnStore::PermuteValues(T* values, const std::vector<int>& indices)
+{
+    std::vector<bool> done(indices.size(), false);
+    for (size_t start = 0; start < indices.size(); start++)
+    {
+        if (done[start] || indices[start] == static_cast<int>(start)) {
+            continue;
+        }
+        const T first = values[start];
+        size_t current = start;
+        while (true)
+        {
+            done[current] = true;
+            const size_t source = indices[current];
+            if (source == start) {
+                values[current] = first;
+                break;
+            }
+            values[current] = values[source];
+            current = source;
+        }
+    }
+}
+
+size_t ColumnStore::GetTypeSize(const char type)
+{
+    switch (type) {
+        case 'B': return sizeof(Char_t);
+        case 'b': return sizeof(UChar_t);
+        case 'S': return sizeof(Short_t);
+        case 's': return sizeof(UShort_t);
+        case 'I': return sizeof(Int_t);
+        case 'i': return sizeof(UInt_t);
+        case 'F': return sizeof(Float_t);
+        case 'D': return sizeof(Double_t);
+        case 'L': return sizeof(Long64_t);
+        case 'l': return sizeof(ULong64_t);
+        case 'G': return sizeof(Long_t);
+        case 'g': return sizeof(ULong_t);
+        case 'O': return sizeof(bool);
+        default: throw std::invalid_argument(std::string("Invalid type: ") + type);
+    }
+}
+
+/**
+ * Convert a value stored at the given address to a float
+ */
+float ColumnStore::FloatCast(const Column& column, const char* address)
+{
+    switch (column.type) {
+        case 'B': return static_cast<float>(*reinterpret_cast<const Char_t*>(address));
+        case 'b': return static_cast<float>(*reinterpret_cast<const UChar_t*>(address));
+        case 'S': return static_cast<float>(*reinterpret_cast<const Short_t*>(address));
+        case 's': return static_cast<float>(*reinterpret_cast<const UShort_t*>(address));
+        case 'I': return static_cast<float>(*reinterpret_cast<const Int_t*>(address));
+        case 'i': return static_cast<float>(*reinterpret_cast<const UInt_t*>(address));
+        case 'F': return *reinterpret_cast<const Float_t*>(address);
+        case 'D': return static_cast<float>(*reinterpret_cast<const Double_t*>(address));
+        case 'L': return static_cast<float>(*reinterpret_cast<const Long64_t*>(address));
+        case 'l': return static_cast<float>(*reinterpret_cast<const ULong64_t*>(address));
+        case 'G': return static_cast<float>(*reinterpret_cast<const Long_t*>(address));
+        case 'g': return static_cast<float>(*reinterpret_cast<const ULong_t*>(address));
+        case 'O': return static_cast<float>(*reinterpret_cast<const bool*>(address));
+        default: throw std::runtime_error("Non-arithmetic type in column: " + column.name);
+    }
+}
+
+float RowView::GetFloat(const int icolumn) const
+{
+    return m_store->GetFloat(icolumn, m_index);
+}
+
+float RowView::GetFloat(const std::string& key) const
+{
+    return m_store->GetFloat(m_store->GetColumnIndex(key), m_index);
+}
+
+void RowView::Print() const
+{
+    std::cout << "[ ";
+    for (int icolumn = 0; icolumn < m_store->GetNColumns(); icolumn++) {
+        std::cout << m_store->GetColumn(icolumn).name << ": " << GetFloat(icolumn) << ", ";
+    }
+    std::cout << "]" << std::endl;
+}
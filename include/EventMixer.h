@@ -3,131 +3,621 @@
 #include <iostream>
 #include <vector>
 #include <map> 
+#include <set>
 #include <variant>
 #include <string>
+#include <sstream>
 #include <algorithm>
 #include <numeric>
 #include <mutex>
+#include <atomic>
+#include <memory>
 #include <cmath>
+#include <future>
+#include <functional>
+#include <deque>
 
 #include <yaml-cpp/yaml.h>
 #include <TTree.h>
 #include <TFile.h>
 #include <TROOT.h>
+#include <TEnv.h>
+#include <TKey.h>
+#include <TDirectory.h>
+#include <TFriendElement.h>
 
-#include "Hist2D.h"
+#include "HistND.h"
 #include "YamlUtils.h"
 #include "TreeReader.h"
 #include "Queue.h"
 #include "Row.h"
-
-namespace physics
-{
-    const float massProton = 0.938272;
-    const float massHe3 = 2.80923;
-}
+#include "ColumnStore.h"
+#include "MixedTreeWriter.h"
+#include "Selection.h"
+#include "PairSelection.h"
+#include "TreeManager.h"
+#include "BinSpill.h"
+#include "SortedCache.h"
+#include "StageCache.h"
 
 using ColumnValue = std::variant<Char_t, UChar_t, Short_t, UShort_t, Int_t, UInt_t, Long64_t, ULong64_t, Float_t, Double_t, bool, std::string>;
 using RowType = std::map<std::string, ColumnValue>;
 
+/**
+ * @brief Range of events of a bin, mixed independently of the rest of the bin
+ */
+struct MixingChunk
+{
+    int bin;
+    int firstEvent;                                 // first event of the chunk in the sorted array
+    int lastEvent;                                  // one past the last event of the chunk in the sorted array
+};
+
 class EventMixer
 {
     public: 
         EventMixer(TTree* inputTree, const char* configFileName);
+        EventMixer(const std::vector<std::string>& inputFileNames, const std::vector<std::string>& treeNames, const char* configFileName);
+        EventMixer(const char* configFileName);
         
         int GetNEvents() const { return m_nEvents; }
         int GetNBins() const { return m_binningHist.GetNBins(); }
+        int GetNChunks() const { return (int)m_chunks.size(); }
+        double GetChunkCost(const int ichunk) const { return static_cast<double>(m_chunks[ichunk].lastEvent - m_chunks[ichunk].firstEvent) * m_bufferSize; }
         int GetNThreads() const { return m_nThreads; }
+        size_t GetMixedSize() const { return m_storeMixedPairs ? m_mixedPairs.size() : m_mixedArray.GetSize(); }
+        size_t GetMaxMixSize() const { return m_maxMixSize; }
+        ColumnStore& GetSortedArray() { return m_sortedArray; }
+        const std::vector<bool>& GetSecondElementMask() const { return m_secondElementMask; }
         void CleanUnderflow();
         void Sorting();
+        bool LoadSortedCache(const std::string& fileName, const std::string& inputKey);
+        void WriteSortedCache(const std::string& fileName, const std::string& inputKey) const;
         void BinMixing(const int ibin);
-        void BinMixingParallel(const int ibin);
+        void BinMixing(const int ibin, std::vector<MixedPair>& mixedPairs, const size_t maxPairs) const;
+        void BinMixing(const int ibin, const int firstEvent, const int lastEvent, std::vector<MixedPair>& mixedPairs, const size_t maxPairs) const;
+        void BinMixingBuffered(const int ibin);
+        void ChunkMixing(const int ichunk, std::vector<MixedPair>& mixedPairs, const size_t maxPairs) const;
+        void ChunkMixing(const int ichunk, std::vector<MixedPair>& mixedPairs);
+        void ChunkMixingBuffered(const int ichunk);
+        void MergeMixedBins();
         void SaveMixedBinTree(TFile * outputFile, const int ibin);
         void SaveMixedTree(TFile * outputFile, const char * treeName);
         void SaveMixedTree(const char * outputFileName) {};
+        bool IsOutOfCore() const { return m_spill != nullptr; }
+        long OutOfCoreMixing(TTree * outputTree, const int nWorkers);
         void Print();
 
     private:
+        void Configure(const char* configFileName);
+        void SelectColumns();
+        void InitStore(ColumnStore& store) const;
+        void ConfigureInputTree(TTree* inputTree) const;
+        void ReadInputTree(TTree* inputTree);
+        void ReadInputTreeParallel(TTree* inputTree);
+        static std::string GetTreePath(TTree* tree);
+        void ReadDirectories(const std::vector<std::string>& inputFileNames, const std::vector<std::string>& treeNames);
+        void ReadDirectory(TDirectory* directory, const std::vector<std::string>& treeNames, ColumnStore& directoryArray) const;
+        std::string GetSortedCacheKey(const std::string& inputKey) const;
+        void BuildChunks();
+        void StoreSelected(ColumnStore& store);
+        void StorePart(const size_t ipart, ColumnStore&& partArray);
+        void MixEvents(const ColumnStore& store, const int binStart, const int firstEvent, const int lastEvent, std::vector<MixedPair>& mixedPairs, const size_t maxPairs) const;
+        void SelectEvents(ColumnStore& store) const;
+        void ComputeBins(const ColumnStore& store, const size_t first, const size_t n, int* bins) const;
+        void AddMixedPair(const int first, const int second);
+        long GetRemainingMixSize(const int ichunk) const;
+
+        static constexpr const char* kMixingBinColumn = "fMixingBin";  // derived column with the mixing class of each event
 
         int m_nThreads;                                 // number of threads for parallel processing
+        bool m_parallelIngest;                          // read the input tree with m_nThreads workers
+        Long64_t m_treeCacheSize;                       // size of the TTreeCache of the input tree [bytes] (0: ROOT default)
         std::mutex m_mutex;                             // mutex for thread safety
 
         int m_bufferSize;                               // size of the buffer for the event mixing
+        int m_chunkSize;                                // maximum number of events in a chunk of a bin (0: do not split the bins)
         int m_nEvents;
-        int m_maxMixSize;
+        size_t m_maxMixSize;
         std::map<std::string, size_t> m_columnTypeCache;// cache the types of the columns in a row
         std::vector<std::string> m_columnDict;          // dictionary of columns to be read from the input tree
         std::vector<std::string> m_columns;             // list of columns to be read from the input tree
 
-        std::vector<Row> m_inputArray;
-        std::vector<Row> m_sortedArray;
-        std::vector<Row> m_mixedArray;
+        ColumnStore m_inputArray;                       // columnar store of the input events
+        ColumnStore m_sortedArray;                      // columnar store of the events sorted by bin
+        ColumnStore m_mixedArray;                       // columnar store of the mixed events
+        bool m_storeMixedPairs;                         // store the mixed events as index pairs, gathered at write time
+        std::vector<MixedPair> m_mixedPairs;            // mixed events as indices in the sorted array
+        std::vector<MixingChunk> m_chunks;              // chunks of the bins, ordered by bin and event
+        std::vector<int> m_binChunkIndex;               // index of the first chunk of the bin
+        std::vector<std::vector<MixedPair>> m_chunkMixedPairs; // per-chunk output of the parallel mixing, merged by MergeMixedBins
+        std::atomic<long> m_mixedCount;                 // pairs mixed by the parallel workers
+        std::unique_ptr<std::atomic<long>[]> m_chunkMixedCount; // pairs mixed in each chunk by the parallel workers, checked against m_maxMixSize
 
         std::vector<int> m_sortedArrayIndex;            // map to the original index of the sorted array
-        Hist2D m_binningHist;                           // histogram with binning. Will be used to store the first position of the bin in the sorted array
+        HistND m_binningHist;                           // histogram with binning. Will be used to store the first position of the bin in the sorted array
         std::vector<int> m_binIndex;                    // index of the first event in the bin
         std::vector<int> m_mixedBinIndex;               // size of the bin
 
-        std::string m_binVariableX, m_binVariableY;     // name of the variables used for the binning
+        std::vector<std::string> m_binVariables;        // name of the variables used for the binning, one per axis
         std::string m_mixingExclusionVariable;          // name of the variable used to exclude pairs from mixing
         std::vector<std::string> m_secondElementColumns;// columns of the second element to be mixed
+        std::vector<bool> m_secondElementMask;          // flag the store columns taken from the second element
+
+        std::vector<int> m_binColumns;                  // handles of the binning variables
+        int m_mixingBinColumn;                          // handle of the derived column with the mixing class of each event
+        int m_exclusionColumn;                          // handle of the mixing exclusion variable
+        Selection m_selection;                          // pre-selection of the input events
+        PairSelection m_pairSelection;                  // selection of the mixed pairs
+
+        std::unique_ptr<BinSpill> m_spill;              // out-of-core mode: events partitioned by bin on disk instead of the input array
+        std::map<size_t, ColumnStore> m_pendingParts;   // parts of the input read by the workers, waiting for the preceding ones
+        size_t m_nextPart = 0;                          // next part of the input to be stored
         
 };
 
 EventMixer::EventMixer(TTree* inputTree, const char* configFileName)
+{
+    Configure(configFileName);
+
+    ConfigureInputTree(inputTree);
+    if (m_parallelIngest && m_nThreads > 1 && inputTree->GetCurrentFile() != nullptr) {
+        ReadInputTreeParallel(inputTree);
+    } else {
+        ReadInputTree(inputTree);
+    }
+}
+
+/**
+ * @brief Read the events directly from the DF_ directories of the input files. In each directory the trees
+ * (e.g. O2he3hadtable and O2he3hadmult) have the same entries and are joined row by row in memory:
+ * no merged file is written
+ */
+EventMixer::EventMixer(const std::vector<std::string>& inputFileNames, const std::vector<std::string>& treeNames, const char* configFileName)
+{
+    Configure(configFileName);
+    ReadDirectories(inputFileNames, treeNames);
+}
+
+/**
+ * @brief Configuration only, the sorted events are then loaded with LoadSortedCache
+ */
+EventMixer::EventMixer(const char* configFileName)
+{
+    Configure(configFileName);
+}
+
+/**
+ * @brief Read the configuration file and initialize the stores and the column handles
+ */
+void EventMixer::Configure(const char* configFileName)
 {
     // Read the configuration file
     YAML::Node config = YAML::LoadFile(configFileName);
 
     m_nThreads = config["NThreads"].as<int>();
+    m_parallelIngest = config["ParallelIngest"] ? config["ParallelIngest"].as<bool>() : false;
+    m_treeCacheSize = config["TreeCacheSizeMB"] ? static_cast<Long64_t>(config["TreeCacheSizeMB"].as<float>() * 1024 * 1024) : 0;
+    if (config["TreeCachePrefetch"] && config["TreeCachePrefetch"].as<bool>()) {
+        gEnv->SetValue("TFile.AsyncPrefetching", 1); // applies to the files opened from now on (parallel ingest)
+    }
     m_bufferSize = config["BufferSize"].as<int>();
+    m_chunkSize = config["ChunkSize"] ? config["ChunkSize"].as<int>() : 0;
 
-    const int nbinsx = config["NbinsX"].as<int>();
-    const int nbinsy = config["NbinsY"].as<int>();
-    const float xmin = config["Xmin"].as<float>();
-    const float xmax = config["Xmax"].as<float>();
-    const float ymin = config["Ymin"].as<float>();
-    const float ymax = config["Ymax"].as<float>();
-    m_binningHist = Hist2D(nbinsx, xmin, xmax, nbinsy, ymin, ymax);
-    m_binVariableX = config["BinVariableX"].as<std::string>();
-    m_binVariableY = config["BinVariableY"].as<std::string>();
+    // mixing classes: a list of axes with uniform or variable bins, or the uniform X/Y binning
+    std::vector<BinAxis> axes;
+    if (config["Binning"]) {
+        for (const auto& axisConfig: config["Binning"]) {
+            m_binVariables.push_back(axisConfig["Variable"].as<std::string>());
+            if (axisConfig["Edges"]) {
+                std::vector<float> edges;
+                YamlUtils::ReadYamlVector(axisConfig["Edges"], edges);
+                axes.push_back(BinAxis(edges));
+            } else {
+                axes.push_back(BinAxis(axisConfig["Nbins"].as<int>(), axisConfig["Min"].as<float>(), axisConfig["Max"].as<float>()));
+            }
+        }
+    } else {
+        m_binVariables.push_back(config["BinVariableX"].as<std::string>());
+        m_binVariables.push_back(config["BinVariableY"].as<std::string>());
+        axes.push_back(BinAxis(config["NbinsX"].as<int>(), config["Xmin"].as<float>(), config["Xmax"].as<float>()));
+        axes.push_back(BinAxis(config["NbinsY"].as<int>(), config["Ymin"].as<float>(), config["Ymax"].as<float>()));
+    }
+    m_binningHist = HistND(axes);
     m_mixingExclusionVariable = config["MixingExclusionVariable"].as<std::string>();
-    m_maxMixSize = config["MaxMixSize"].as<int>();
+    m_maxMixSize = config["MaxMixSize"].as<size_t>();
+    m_storeMixedPairs = config["StoreMixedPairs"] ? config["StoreMixedPairs"].as<bool>() : false;
+
+    // pre-selection: a single expression or a list of expressions, all of them have to be satisfied
+    std::vector<std::string> selection;
+    if (config["Selection"] && config["Selection"].IsSequence()) {
+        YamlUtils::ReadYamlVector(config["Selection"], selection);
+    } else if (config["Selection"]) {
+        selection.push_back(config["Selection"].as<std::string>());
+    }
+    m_selection = Selection(selection);
+    m_selection.Print();
+    m_pairSelection = PairSelection(config["PairSelection"]);
+    m_pairSelection.Print();
 
     // Prepare to read from the input tree
     YamlUtils::ReadYamlVector(config["ColumnDict"], m_columnDict);
     YamlUtils::ReadYamlVector(config["Columns"], m_columns);
     YamlUtils::ReadYamlVector(config["SecondElementColumns"], m_secondElementColumns);  
+    SelectColumns();
     
-    Row inputRow;
-    inputRow.InitRowFromDict(m_columnDict);
-    inputRow.SetBranchAddressesFromDict(inputTree, m_columnDict);
+    InitStore(m_inputArray);
+    InitStore(m_sortedArray);
+    InitStore(m_mixedArray);
+    m_pairSelection.Resolve(m_inputArray);
+
+    m_secondElementMask.assign(m_mixedArray.GetNColumns(), false);
+    for (const auto& column: m_secondElementColumns) {
+        m_secondElementMask[m_mixedArray.GetColumnIndex(column)] = true;
+    }
+    for (const int column: m_pairSelection.GetSecondDerivedColumns()) {
+        m_secondElementMask[column] = true;
+    }
+
+    // resolve the schema once, column handles are shared by the input, sorted and mixed stores
+    for (const auto& variable: m_binVariables) {
+        m_binColumns.push_back(m_inputArray.GetColumnIndex(variable));
+    }
+    m_mixingBinColumn = m_inputArray.GetColumnHandle<Int_t>(kMixingBinColumn);
+    m_exclusionColumn = m_inputArray.GetColumnIndex(m_mixingExclusionVariable);
+    m_selection.Compile(m_inputArray);
+
+    // out-of-core mode: the selected events are spilled to one file per bin, bins are then mixed one at a time
+    m_nEvents = 0;
+    if (config["OutOfCore"] && config["OutOfCore"].as<bool>()) {
+        const std::string spillDirectory = config["SpillDirectory"] ? config["SpillDirectory"].as<std::string>() : ".";
+        const size_t spillBufferSize = static_cast<size_t>((config["SpillBufferMB"] ? config["SpillBufferMB"].as<float>() : 512.f) * 1024 * 1024);
+        m_spill = std::make_unique<BinSpill>(m_inputArray, m_binningHist.GetNBins(), spillDirectory, spillBufferSize);
+    }
+}
+
+/**
+ * @brief Restrict the column dictionary to the columns that are actually used: the output columns, the binning
+ * and exclusion variables, the pre-selection and the pair kinematics. The other branches are not read
+ */
+void EventMixer::SelectColumns()
+{
+    std::set<std::string> requiredColumns(m_columns.begin(), m_columns.end());
+    requiredColumns.insert(m_secondElementColumns.begin(), m_secondElementColumns.end());
+    requiredColumns.insert(m_binVariables.begin(), m_binVariables.end());
+    requiredColumns.insert(m_mixingExclusionVariable);
+    for (const auto& column: m_selection.GetColumnNames()) {
+        requiredColumns.insert(column);
+    }
+    for (const auto& column: m_pairSelection.GetColumnNames()) {
+        requiredColumns.insert(column);
+    }
+
+    std::vector<std::string> selectedDict;
+    std::set<std::string> dictColumns;
+    for (const auto& line: m_columnDict) {
+        const std::string column = line.substr(0, line.find('/'));
+        dictColumns.insert(column);
+        if (requiredColumns.find(column) != requiredColumns.end()) {
+            selectedDict.push_back(line);
+        }
+    }
+    for (const auto& column: requiredColumns) {
+        if (dictColumns.find(column) == dictColumns.end()) {
+            std::cerr << "Column " << column << " is not in ColumnDict, ignored" << std::endl;
+        }
+    }
+    std::cout << "Reading " << selectedDict.size() << "/" << m_columnDict.size() << " columns" << std::endl;
+    m_columnDict = selectedDict;
+}
+
+/**
+ * @brief Initialize a store with the columns of the dictionary, the derived columns of the pair selection
+ * and the mixing class of the events
+ */
+void EventMixer::InitStore(ColumnStore& store) const
+{
+    store.InitFromDict(m_columnDict);
+    m_pairSelection.AddDerivedColumns(store);
+    store.AddDerivedColumn(kMixingBinColumn, GetLeafType<Int_t>());
+}
+
+/**
+ * @brief Activate only the branches in the column dictionary and set up the TTreeCache for them.
+ * Columns of the dictionary missing in the tree are skipped (trees joined row by row hold part of the columns)
+ */
+void EventMixer::ConfigureInputTree(TTree* inputTree) const
+{
+    std::vector<std::string> branchNames;
+    for (const auto& line: m_columnDict) {
+        const std::string branchName = line.substr(0, line.find('/'));
+        if (inputTree->GetBranch(branchName.c_str())) {
+            branchNames.push_back(branchName);
+        }
+    }
+
+    inputTree->SetBranchStatus("*", false);
+    for (const auto& branchName: branchNames) {
+        inputTree->SetBranchStatus(branchName.c_str(), true);
+    }
+
+    if (m_treeCacheSize > 0) {
+        inputTree->SetCacheSize(m_treeCacheSize);
+    }
+    for (const auto& branchName: branchNames) {
+        inputTree->AddBranchToCache(branchName.c_str(), true);
+    }
+    inputTree->StopCacheLearningPhase();
+}
+
+/**
+ * @brief Pre-selection of the events of a store: the configured selection and the binning range.
+ * The selection is evaluated in batches on the columns and the mixing class of every event is stored in
+ * its derived column (computed only here, Sorting reuses it). Then the store is compacted in place
+ * and the other derived columns of the selected events are computed
+ */
+void EventMixer::SelectEvents(ColumnStore& store) const
+{
+    std::vector<char> mask;
+    m_selection.Evaluate(store, mask);
+
+    Int_t* bins = store.GetData<Int_t>(m_mixingBinColumn);
+    ComputeBins(store, 0, store.GetSize(), bins);
+    const int overflowBin = m_binningHist.GetOverflowBin();
+    for (size_t irow = 0; irow < store.GetSize(); irow++) {
+        mask[irow] &= bins[irow] != overflowBin;
+    }
+    store.Filter(mask);
+    m_pairSelection.ComputeDerived(store);
+}
+
+/**
+ * @brief Mixing class of the rows [first, first + n) of a store
+ * @param bins Output, global bin of each row (the overflow bin if outside the binning range)
+ */
+void EventMixer::ComputeBins(const ColumnStore& store, const size_t first, const size_t n, int* bins) const
+{
+    const int nAxes = m_binningHist.GetNDimensions();
+    std::vector<float> axisValues(nAxes * n);       // values of each axis, contiguous
+    std::vector<const float*> axisSpans(nAxes);
+    for (int iaxis = 0; iaxis < nAxes; iaxis++) {
+        store.GetFloats(m_binColumns[iaxis], first, n, axisValues.data() + iaxis * n);
+        axisSpans[iaxis] = axisValues.data() + iaxis * n;
+    }
+    m_binningHist.GetBins(axisSpans, n, bins);
+}
+
+/**
+ * @brief Read the selected events of the input tree. Entries are read in blocks, each block is filtered
+ * by SelectEvents before being stored
+ */
+void EventMixer::ReadInputTree(TTree* inputTree)
+{
+    const Long64_t blockSize = 100000;
+    ColumnStore blockArray;
+    InitStore(blockArray);
+    blockArray.SetBranchAddresses(inputTree);
+    blockArray.Reserve(blockSize);
 
     ROOT::EnableImplicitMT(m_nThreads);
 
-    m_nEvents = inputTree->GetEntries();
-    const int underflowBin = m_binningHist.GetNBins();
-    m_inputArray.reserve(m_nEvents);
-    int filteredSize = 0;
-    for (int ientry = 0; ientry < m_nEvents; ientry++)
+    const Long64_t nEntries = inputTree->GetEntries();
+    for (Long64_t ientry = 0; ientry < nEntries; ientry++)
     {
-        if (ientry % 100000 == 0) std::cout << "Processing event: " << ientry << "/" << m_nEvents << "\r" << std::flush;
+        if (ientry % blockSize == 0) std::cout << "Processing event: " << ientry << "/" << nEntries << "\r" << std::flush;
         inputTree->GetEntry(ientry);
-        if (std::abs(inputRow.GetFloat("fNSigmaTPCHad")) > 2 || std::abs(inputRow.GetFloat("fNSigmaTPCHe3")) > 2) {
-            continue;
-        }
-        if (!m_binningHist.IsUnderflow(inputRow.GetFloat(m_binVariableX), inputRow.GetFloat(m_binVariableY)))
+        blockArray.PushStaged();
+        if (blockArray.GetSize() == blockSize || ientry + 1 == nEntries)
         {
-            m_inputArray.push_back(inputRow);
-            filteredSize++;
+            SelectEvents(blockArray);
+            StoreSelected(blockArray);
+            blockArray.Clear();
+            blockArray.Reserve(blockSize);
         }
     }
     std::cout << std::endl;
-    m_nEvents = filteredSize;
 
     ROOT::DisableImplicitMT();
 }
 
+/**
+ * @brief Read the selected events of the input tree with m_nThreads workers.
+ * The entry range is split in clusters. Each worker opens its own handle to the input file, then decodes and filters
+ * the clusters it takes from a shared queue into per-cluster columnar buffers. The buffers are stored in cluster
+ * order, so the result is the same as for the serial reading
+ */
+void EventMixer::ReadInputTreeParallel(TTree* inputTree)
+{
+    const std::string fileName = inputTree->GetCurrentFile()->GetName();
+    const std::string treePath = GetTreePath(inputTree);
+    std::vector<std::string> friendPaths;                           // friends in the same file, attached again by every worker
+    if (inputTree->GetListOfFriends()) {
+        TIter nextFriend(inputTree->GetListOfFriends());
+        TFriendElement * friendElement;
+        while ((friendElement = (TFriendElement*)nextFriend())) {
+            friendPaths.push_back(GetTreePath(friendElement->GetTree()));
+        }
+    }
+
+    const Long64_t nEntries = inputTree->GetEntries();
+    std::vector<std::pair<Long64_t, Long64_t>> clusters;             // [first, last) entries of each cluster
+    auto clusterIterator = inputTree->GetClusterIterator(0);
+    for (Long64_t start = clusterIterator(); start < nEntries; start = clusterIterator()) {
+        clusters.push_back({start, std::min(clusterIterator.GetNextEntry(), nEntries)});
+    }
+    std::cout << "Reading " << nEntries << " entries in " << clusters.size() << " clusters with " << m_nThreads << " threads" << std::endl;
+
+    ROOT::EnableThreadSafety();
+
+    m_nextPart = 0;
+    std::atomic<size_t> nextCluster(0);
+    auto worker = [&] () {
+        std::unique_ptr<TFile> inputFile(TFile::Open(fileName.c_str(), "READ"));    // owns the trees, deleted with them
+        if (!inputFile || inputFile->IsZombie()) {
+            throw std::runtime_error("Cannot open input file: " + fileName);
+        }
+        TTree * tree = (TTree *) inputFile->Get(treePath.c_str());
+        if (!tree) {
+            throw std::runtime_error("Missing tree " + treePath + " in " + fileName);
+        }
+        for (const auto& friendPath: friendPaths) {
+            TTree * friendTree = (TTree *) inputFile->Get(friendPath.c_str());
+            if (!friendTree) {
+                throw std::runtime_error("Missing friend tree " + friendPath + " in " + fileName);
+            }
+            tree->AddFriend(friendTree);
+        }
+        ConfigureInputTree(tree);
+        for (size_t icluster = nextCluster++; icluster < clusters.size(); icluster = nextCluster++)
+        {
+            ColumnStore clusterArray;
+            InitStore(clusterArray);
+            clusterArray.SetBranchAddresses(tree);
+            clusterArray.Reserve(clusters[icluster].second - clusters[icluster].first);
+            for (Long64_t ientry = clusters[icluster].first; ientry < clusters[icluster].second; ientry++)
+            {
+                tree->GetEntry(ientry);
+                clusterArray.PushStaged();
+            }
+            SelectEvents(clusterArray);
+            StorePart(icluster, std::move(clusterArray));
+        }
+    };
+
+    std::vector<std::future<void>> futures;
+    for (int ithread = 0; ithread < m_nThreads; ithread++) {
+        futures.push_back(std::async(std::launch::async, worker));
+    }
+    for (auto & future : futures) {
+        future.get();
+    }
+
+    std::cout << "Selected events: " << m_nEvents << "/" << nEntries << std::endl;
+}
+
+/**
+ * @brief Path of a tree inside its file
+ */
+std::string EventMixer::GetTreePath(TTree* tree)
+{
+    std::string treePath = tree->GetDirectory()->GetPath();         // "file.root:/directory"
+    treePath = treePath.substr(treePath.find(":/") + 2);
+    return treePath.empty() ? tree->GetName() : treePath + "/" + tree->GetName();
+}
+
+/**
+ * @brief Read the selected events of the DF_ directories of the input files, joining the trees of each directory
+ * in memory. With ParallelIngest the directories of all the files are taken from a shared queue by m_nThreads workers,
+ * each with its own file handle, so that the reading scales with the number of files. The directories are concatenated
+ * in file and directory order (for a single file, as TTree::MergeTrees would do) and the mixing bins are built
+ * on all of them
+ */
+void EventMixer::ReadDirectories(const std::vector<std::string>& inputFileNames, const std::vector<std::string>& treeNames)
+{
+    if (treeNames.empty()) {
+        throw std::invalid_argument("EventMixer: no tree to read in the directories");
+    }
+    const std::vector<InputDirectory> directories = ListDirectories(inputFileNames);
+
+    const int nThreads = m_parallelIngest ? std::max(1, std::min(m_nThreads, (int)directories.size())) : 1;
+    std::cout << "Reading " << directories.size() << " directories in " << inputFileNames.size() << " files with " << nThreads << " threads" << std::endl;
+    if (nThreads > 1) {
+        ROOT::EnableThreadSafety();
+    }
+
+    m_nextPart = 0;
+    std::atomic<size_t> nextDirectory(0);
+    auto worker = [&] () {
+        InputFileHandle workerFile;
+        for (size_t idirectory = nextDirectory++; idirectory < directories.size(); idirectory = nextDirectory++) {
+            const InputDirectory& inputDirectory = directories[idirectory];
+            TDirectory * directory = (TDirectory *) workerFile.Get(inputDirectory.fileName)->Get(inputDirectory.directoryName.c_str());
+            ColumnStore directoryArray;
+            ReadDirectory(directory, treeNames, directoryArray);
+            delete directory; // the file stays open for the next directories, do not keep them all in memory
+            StorePart(idirectory, std::move(directoryArray));
+        }
+    };
+
+    std::vector<std::future<void>> futures;
+    for (int ithread = 0; ithread < nThreads; ithread++) {
+        futures.push_back(std::async(std::launch::async, worker));
+    }
+    for (auto & future : futures) {
+        future.get();
+    }
+
+    std::cout << "Selected events: " << m_nEvents << std::endl;
+}
+
+/**
+ * @brief Read the trees of a directory into a store, row by row: every tree fills its columns of the staging row.
+ * The selected events are kept
+ */
+void EventMixer::ReadDirectory(TDirectory* directory, const std::vector<std::string>& treeNames, ColumnStore& directoryArray) const
+{
+    InitStore(directoryArray);
+    std::vector<TTree *> trees;
+    std::vector<bool> bound;
+    for (const auto& treeName: treeNames) {
+        TTree * tree = (TTree *) directory->Get(treeName.c_str());
+        if (!tree) {
+            throw std::runtime_error("Missing tree " + treeName + " in directory " + directory->GetName());
+        }
+        if (!trees.empty() && tree->GetEntries() != trees.front()->GetEntries()) {
+            throw std::runtime_error("Trees with different number of entries in directory " + std::string(directory->GetName()));
+        }
+        ConfigureInputTree(tree);
+        directoryArray.SetBranchAddresses(tree, bound);
+        trees.push_back(tree);
+    }
+    for (int icolumn = 0; icolumn < directoryArray.GetNColumns(); icolumn++) {
+        if (!directoryArray.GetColumn(icolumn).derived && !bound[icolumn]) {
+            throw std::runtime_error("Column " + directoryArray.GetColumn(icolumn).name + " not found in directory " + directory->GetName());
+        }
+    }
+
+    const Long64_t nEntries = trees.front()->GetEntries();
+    directoryArray.Reserve(nEntries);
+    for (Long64_t ientry = 0; ientry < nEntries; ientry++) {
+        for (auto tree: trees) {
+            tree->GetEntry(ientry);
+        }
+        directoryArray.PushStaged();
+    }
+    for (auto tree: trees) {
+        delete tree; // with its baskets and TTreeCache
+    }
+    SelectEvents(directoryArray);
+}
+
+/**
+ * @brief Store selected events: append them to the input array or, out of core, spill them to the files of their bins
+ */
+void EventMixer::StoreSelected(ColumnStore& store)
+{
+    if (m_spill) {
+        m_spill->Add(store, store.GetData<Int_t>(m_mixingBinColumn));
+    } else {
+        m_inputArray.Append(store);
+    }
+    m_nEvents += store.GetSize();
+}
+
+/**
+ * @brief Hand over a part of the input (cluster, directory) read by a worker (thread safe).
+ * Parts are stored in order as soon as the preceding ones are, so only the parts read ahead are kept in memory
+ */
+void EventMixer::StorePart(const size_t ipart, ColumnStore&& partArray)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pendingParts[ipart] = std::move(partArray);
+    for (auto it = m_pendingParts.begin(); it != m_pendingParts.end() && it->first == m_nextPart; it = m_pendingParts.erase(it)) {
+        StoreSelected(it->second);
+        m_nextPart++;
+    }
+}
+
 void EventMixer::CleanUnderflow()
 {
     /*
@@ -163,200 +653,358 @@ void EventMixer::CleanUnderflow()
 }
 
 /**
- * @brief Sort the input array according to the binning variables
+ * @brief Sort the input array according to the binning variables.
+ * Counting sort with m_nThreads workers on the mixing classes computed at ingest: each worker counts the bins of a contiguous range of events,
+ * the counts give the first position of each (bin, worker) pair and the workers scatter the indices of their events
+ * there. The sort is stable: events of a bin keep the input order
  */
 void EventMixer::Sorting()
 {
     std::cout << "Sorting" << std::endl;
-    std::vector<int> binPositionArray(m_inputArray.size()); // bin index of each event
-    std::transform(m_inputArray.begin(), m_inputArray.end(), binPositionArray.begin(), [&](Row& row) {
-        return m_binningHist.GetBin(row.GetFloat(m_binVariableX), row.GetFloat(m_binVariableY));
+    const int nEvents = m_inputArray.GetSize();
+    const int nBins = m_binningHist.GetNBins();
+    const int nThreads = std::max(1, std::min(m_nThreads, nEvents));
+    auto GetRangeStart = [&] (const int ithread) { return static_cast<int>(static_cast<long>(nEvents) * ithread / nThreads); };
+    auto RunWorkers = [&] (const std::function<void(int)>& worker) {
+        std::vector<std::future<void>> futures;
+        for (int ithread = 0; ithread < nThreads; ithread++) {
+            futures.push_back(std::async(std::launch::async, worker, ithread));
+        }
+        for (auto & future : futures) {
+            future.get();
+        }
+    };
+
+    // number of events per bin in the range of each worker
+    const Int_t* eventBins = m_inputArray.GetData<Int_t>(m_mixingBinColumn);
+    std::vector<std::vector<int>> binOffsets(nThreads, std::vector<int>(nBins, 0));
+    RunWorkers([&] (const int ithread) {
+        std::vector<int>& binCounts = binOffsets[ithread];
+        for (int i = GetRangeStart(ithread); i < GetRangeStart(ithread + 1); i++) {
+            binCounts[eventBins[i]]++;
+        }
     });
 
-    std::vector<std::pair<int, int>> binPositionIndexArray(m_inputArray.size()); // index and bin index of each event
-    for (size_t i = 0; i < m_inputArray.size(); i++)
+    // first index of each bin in the sorted array and, within the bin, of the events of each worker
+    m_binIndex.assign(nBins, 0);
+    int position = 0;
+    for (int bin = 0; bin < nBins; bin++)
     {
-        binPositionIndexArray[i] = std::make_pair(i, binPositionArray[i]);
+        m_binIndex[bin] = position;
+        for (int ithread = 0; ithread < nThreads; ithread++) {
+            const int binCount = binOffsets[ithread][bin];
+            binOffsets[ithread][bin] = position;
+            position += binCount;
+        }
+        m_binningHist.SetBinContent(bin, position - m_binIndex[bin]);
     }
 
-    std::sort(binPositionIndexArray.begin(), binPositionIndexArray.end(), [](std::pair<int, int>& a, std::pair<int, int>& b) {
-        return a.second < b.second;
+    std::vector<int> sortedIndices(nEvents);
+    RunWorkers([&] (const int ithread) {
+        std::vector<int>& offsets = binOffsets[ithread];
+        for (int i = GetRangeStart(ithread); i < GetRangeStart(ithread + 1); i++) {
+            sortedIndices[offsets[eventBins[i]]++] = i;
+        }
     });
 
+    // the input array becomes the sorted array, columns are permuted in place (one column per worker at a time)
     std::cout << "Filling sorted arrays" << std::endl;
-    m_sortedArray.clear();
-    m_sortedArray.reserve(binPositionIndexArray.size());
-    for (auto& [index, bin]: binPositionIndexArray)
-    {
-        m_sortedArray.push_back(m_inputArray[index]);
-        m_binningHist.Fill(m_inputArray[index].GetFloat(m_binVariableX), m_inputArray[index].GetFloat(m_binVariableY));
-    }
+    std::swap(m_sortedArray, m_inputArray);
+    m_inputArray.Clear();
+    RunWorkers([&] (const int ithread) {
+        for (int icolumn = ithread; icolumn < m_sortedArray.GetNColumns(); icolumn += nThreads) {
+            m_sortedArray.PermuteColumn(icolumn, sortedIndices);
+        }
+    });
+    BuildChunks();
+}
 
-    m_inputArray.clear();
+/**
+ * @brief Split the sorted bins in chunks and prepare the buffers of the mixing
+ */
+void EventMixer::BuildChunks()
+{
+    m_mixedBinIndex.resize(m_binIndex.size(), 0);
 
-    m_binIndex.resize(m_binningHist.GetNBins(), 0);
-    std::vector<float> binData = m_binningHist.GetData();
-    for (int bin = 0; bin < m_binningHist.GetNBins(); bin++)
+    // split the bins in chunks of at most m_chunkSize events. Each bin has at least one chunk
+    m_chunks.clear();
+    m_binChunkIndex.resize(m_binIndex.size(), 0);
+    for (size_t ibin = 0; ibin + 1 < m_binIndex.size(); ibin++)
     {
-        m_binIndex[bin] = static_cast<int>(binData[bin]);
+        m_binChunkIndex[ibin] = m_chunks.size();
+        const int binEnd = m_binIndex[ibin + 1];
+        int firstEvent = m_binIndex[ibin];
+        do {
+            const int lastEvent = m_chunkSize > 0 ? std::min(firstEvent + m_chunkSize, binEnd) : binEnd;
+            m_chunks.push_back({static_cast<int>(ibin), firstEvent, lastEvent});
+            firstEvent = lastEvent;
+        } while (firstEvent < binEnd);
+    }
+    m_binChunkIndex.back() = m_chunks.size();
+
+    m_chunkMixedPairs.resize(m_chunks.size());
+    m_mixedCount = 0;
+    m_chunkMixedCount = std::make_unique<std::atomic<long>[]>(m_chunks.size());
+    for (size_t ichunk = 0; ichunk < m_chunks.size(); ichunk++) {
+        m_chunkMixedCount[ichunk] = 0;
     }
-    // make binIndex store the first index of the bin in the sorted array
-    std::exclusive_scan(m_binIndex.begin(), m_binIndex.end(), m_binIndex.begin(), 0);
-    m_mixedBinIndex.resize(m_binIndex.size(), 0);
 }
 
 /**
- * @brief Mix the events in a given bin (not thread safe)
+ * @brief Mix the events in a given bin and store them (not thread safe)
  * @param ibin Index of the bin
  */
 void EventMixer::BinMixing(const int ibin)
 {
-    const int binStart = m_binIndex[ibin];
-    //const int binEnd = m_binIndex[ibin] + 10; // checking purpose
-    const int binEnd = m_binIndex[ibin + 1];
+    const size_t mixedSize = GetMixedSize();
+    if (mixedSize >= m_maxMixSize) {
+        return;
+    }
 
-    const float massHe3 = physics::massHe3;
-    const float massProton = physics::massProton;
-    
-    Queue<Row> queue(m_bufferSize);
-    int currentlyMixed = 0;
+    std::vector<MixedPair> mixedPairs;
+    BinMixing(ibin, mixedPairs, m_maxMixSize - mixedSize);
+    for (const auto& pair: mixedPairs) {
+        AddMixedPair(pair.first, pair.second);
+    }
+    std::cout << "Mixed size: " << GetMixedSize() << "/" << m_maxMixSize << "\r" << std::flush;
+
+    m_mixedBinIndex[ibin+1] = mixedPairs.size() + m_mixedBinIndex[ibin];
+}
+
+/**
+ * @brief Content hash of everything the sorted events depend on: the inputs (described by the caller), the columns read,
+ * the pre-selection and the binning. Pair cuts, BufferSize and the other mixing settings can change between runs
+ */
+std::string EventMixer::GetSortedCacheKey(const std::string& inputKey) const
+{
+    std::stringstream key;
+    key.precision(9);
+    key << "Inputs: " << inputKey << "\nColumns:";
+    for (const auto& line: m_columnDict) {
+        key << " " << line;
+    }
+    key << "\nSelection:";
+    for (const auto& expression: m_selection.GetExpressions()) {
+        key << " (" << expression << ")";
+    }
+    key << "\nBinning:";
+    for (int iaxis = 0; iaxis < m_binningHist.GetNDimensions(); iaxis++) {
+        key << " " << m_binVariables[iaxis] << "[";
+        for (const float edge: m_binningHist.GetAxis(iaxis).GetEdges()) {
+            key << " " << edge;
+        }
+        key << " ]";
+    }
+    return StageCache::Hash(key.str());
+}
+
+/**
+ * @brief Load the sorted events from a cache written by WriteSortedCache, instead of reading and sorting the input.
+ * The four-momenta of the pair selection are computed again, the mass hypotheses can change between runs
+ * @param inputKey Description of the inputs, the cache is used only if it was written with the same one
+ * @return false if there is no valid cache
+ */
+bool EventMixer::LoadSortedCache(const std::string& fileName, const std::string& inputKey)
+{
+    if (!SortedCache::Read(fileName, GetSortedCacheKey(inputKey), m_sortedArray, m_binIndex)) {
+        return false;
+    }
+    if ((int)m_binIndex.size() != m_binningHist.GetNBins()) {
+        std::cout << "Sorted cache " << fileName << " has a different number of bins, not used" << std::endl;
+        m_sortedArray.Clear();
+        return false;
+    }
+    std::cout << "Sorted events loaded from " << fileName << std::endl;
+    m_nEvents = m_sortedArray.GetSize();
+    for (int bin = 0; bin < m_binningHist.GetNBins(); bin++) {
+        const int binEnd = bin + 1 < m_binningHist.GetNBins() ? m_binIndex[bin + 1] : m_nEvents;
+        m_binningHist.SetBinContent(bin, binEnd - m_binIndex[bin]);
+    }
+    m_pairSelection.ComputeDerived(m_sortedArray);
+    BuildChunks();
+    return true;
+}
+
+/**
+ * @brief Write the sorted events and the bin index, to be loaded by the next runs with LoadSortedCache
+ */
+void EventMixer::WriteSortedCache(const std::string& fileName, const std::string& inputKey) const
+{
+    SortedCache::Write(fileName, GetSortedCacheKey(inputKey), m_sortedArray, m_binIndex);
+}
+
+/**
+ * @brief Mix the events in a given bin. Only reads the sorted array, can be called concurrently on different bins
+ * @param ibin Index of the bin
+ * @param mixedPairs Output, the accepted pairs are appended
+ * @param maxPairs Stop mixing once this number of pairs is reached
+ */
+void EventMixer::BinMixing(const int ibin, std::vector<MixedPair>& mixedPairs, const size_t maxPairs) const
+{
+    //BinMixing(ibin, m_binIndex[ibin], m_binIndex[ibin] + 10, mixedPairs, maxPairs); // checking purpose
+    BinMixing(ibin, m_binIndex[ibin], m_binIndex[ibin + 1], mixedPairs, maxPairs);
+}
+
+/**
+ * @brief Mix the events in [firstEvent, lastEvent) of a given bin. The buffer is first filled with the events
+ * preceding firstEvent in the bin, so that the result is the same as for the corresponding part of the whole bin.
+ * Only reads the sorted array, can be called concurrently on different bins and ranges
+ * @param ibin Index of the bin
+ * @param firstEvent First event to mix (index in the sorted array)
+ * @param lastEvent One past the last event to mix (index in the sorted array)
+ * @param mixedPairs Output, the accepted pairs are appended
+ * @param maxPairs Stop mixing once this number of pairs is reached
+ */
+void EventMixer::BinMixing(const int ibin, const int firstEvent, const int lastEvent, std::vector<MixedPair>& mixedPairs, const size_t maxPairs) const
+{
+    MixEvents(m_sortedArray, m_binIndex[ibin], firstEvent, lastEvent, mixedPairs, maxPairs);
+}
 
-    for (int ievent = binStart; ievent < binEnd; ievent++)
+/**
+ * @brief Mix the events in [firstEvent, lastEvent) of a store, within a bin starting at binStart. Only reads the store
+ * @param mixedPairs Output, the accepted pairs (indices in the store) are appended
+ * @param maxPairs Stop mixing once this number of pairs is reached
+ */
+void EventMixer::MixEvents(const ColumnStore& store, const int binStart, const int firstEvent, const int lastEvent, std::vector<MixedPair>& mixedPairs, const size_t maxPairs) const
+{
+    Queue<int> queue(m_bufferSize);                 // indices of the previous events in the sorted array
+    std::vector<unsigned char> accept(m_bufferSize);
+    const size_t initialSize = mixedPairs.size();
+
+    for (int ievent = std::max(binStart, firstEvent - m_bufferSize); ievent < firstEvent; ievent++)
     {
-        Row currentRow = m_sortedArray[ievent];
-        Row mixedRow = currentRow;
+        queue.Fill(ievent);
+    }
 
-        float energyHe3 = std::sqrt(massHe3 * massHe3 + 
-                                            currentRow.GetFloat("fPtHe3") * std::cosh(currentRow.GetFloat("fEtaHe3")) * 
-                                            currentRow.GetFloat("fPtHe3") * std::cosh(currentRow.GetFloat("fEtaHe3")));
+    for (int ievent = firstEvent; ievent < lastEvent; ievent++)
+    {
+        // pair selection of the current event with all the events in the buffer at once
+        const int queueSize = queue.GetSize();
+        const int* queueIndices = queue.GetData();
+        m_pairSelection.Evaluate(store, ievent, queueIndices, queueSize, accept.data());
        
-        for (int i = 0; i < queue.GetSize(); i++)
+        for (int i = 0; i < queueSize; i++)
         {
-            auto rowToMix = queue.GetElement(i);
-            if (currentRow[m_mixingExclusionVariable] == rowToMix[m_mixingExclusionVariable]) {
-                continue;
-            }
-
-            float energyProton = std::sqrt(massProton * massProton + 
-                                           rowToMix.GetFloat("fPtHad") * std::cosh(rowToMix.GetFloat("fEtaHad")) * 
-                                           rowToMix.GetFloat("fPtHad") * std::cosh(rowToMix.GetFloat("fEtaHad")));              
-
-            float px = currentRow.GetFloat("fPtHe3") * std::cos(currentRow.GetFloat("fPhiHe3")) + 
-                       rowToMix.GetFloat("fPtHad") * std::cos(rowToMix.GetFloat("fPhiHad"));
-            float py = currentRow.GetFloat("fPtHe3") * std::sin(currentRow.GetFloat("fPhiHe3")) + 
-                       rowToMix.GetFloat("fPtHad") * std::sin(rowToMix.GetFloat("fPhiHad"));
-            float pz = currentRow.GetFloat("fPtHe3") * std::sinh(currentRow.GetFloat("fEtaHe3")) + 
-                       rowToMix.GetFloat("fPtHad") * std::sinh(rowToMix.GetFloat("fEtaHad"));               
-
-            float invariantMass = std::sqrt((energyHe3 + energyProton) * (energyHe3 + energyProton) - 
-                                            px * px - py * py - pz * pz);
-            
-            if (invariantMass > 4.15314) {
+            const int jevent = queueIndices[i];
+            if (!accept[i] || store.IsEqual(m_exclusionColumn, ievent, jevent)) {
                 continue;
             }
 
-            for (auto & column: m_secondElementColumns) {
-                mixedRow[column] = rowToMix[column];
-            }
-
-            //std::cout << std::endl << "mixedRow after mixing: " << std::endl;
-            //mixedRow.Print();
-            //std::cout << "invariant mass: " << invariantMass << std::endl;
-            m_mixedArray.push_back(mixedRow);
-            //std::cout << "mixedRow pushed" << std::endl;
-            //m_mixedArray[m_mixedArray.size()-1].Print();
-            currentlyMixed++;
-            if (m_mixedArray.size() % 100000 == 0) {
-                std::cout << "Mixed size: " << m_mixedArray.size() << "/" << m_maxMixSize << "\r" << std::flush;
-            }
-            if (m_mixedArray.size() >= m_maxMixSize) {
+            mixedPairs.push_back({ievent, jevent});
+            if (mixedPairs.size() - initialSize >= maxPairs) {
                 return;
             }
         }
 
-        queue.Fill(currentRow);
+        queue.Fill(ievent);
         
     }
-    
-    m_mixedBinIndex[ibin+1] = currentlyMixed + m_mixedBinIndex[ibin];
 }
 
 /**
- * @brief Mix the events in a given bin (thread safe)
+ * @brief Mix the events in a given bin into the per-chunk buffers of the bin (thread safe).
+ * The buffers are merged in bin order by MergeMixedBins
  * @param ibin Index of the bin
  */
-void EventMixer::BinMixingParallel(const int ibin)
+void EventMixer::BinMixingBuffered(const int ibin)
 {
-    const int binStart = m_binIndex[ibin];
-    const int binEnd = m_binIndex[ibin + 1];
+    for (int ichunk = m_binChunkIndex[ibin]; ichunk < m_binChunkIndex[ibin + 1]; ichunk++) {
+        ChunkMixingBuffered(ichunk);
+    }
+}
 
-    const float massHe3 = physics::massHe3;
-    const float massProton = physics::massProton;
-    
-    Queue<Row> queue(m_bufferSize);
-    int currentlyMixed = 0;
+/**
+ * @brief Mix the events of a chunk of a bin. Only reads the sorted array, can be called concurrently
+ * @param ichunk Index of the chunk
+ * @param mixedPairs Output, the accepted pairs are appended
+ * @param maxPairs Stop mixing once this number of pairs is reached
+ */
+void EventMixer::ChunkMixing(const int ichunk, std::vector<MixedPair>& mixedPairs, const size_t maxPairs) const
+{
+    const MixingChunk& chunk = m_chunks[ichunk];
+    BinMixing(chunk.bin, chunk.firstEvent, chunk.lastEvent, mixedPairs, maxPairs);
+}
 
-    for (int ievent = binStart; ievent < binEnd; ievent++)
-    {
-        Row currentRow = m_sortedArray[ievent];
-        Row mixedRow = currentRow;
-        queue.Fill(currentRow);
-
-        /*
-        float energyHe3 = std::sqrt(massHe3 * massHe3 + 
-                                            currentRow.GetFloat("fPtHe3") * std::cosh(currentRow.GetFloat("fEtaHe3")) * 
-                                            currentRow.GetFloat("fPtHe3") * std::cosh(currentRow.GetFloat("fEtaHe3")));
-        */
-       
-        if (ievent == binStart) {
-            continue;
-        } else {
-            for (int i = 0; i < queue.GetSize()-1; i++)
-            {
-                auto rowToMix = queue.GetElement(i);
-                if (currentRow[m_mixingExclusionVariable] == rowToMix[m_mixingExclusionVariable]) {
-                    continue;
-                }
+/**
+ * @brief Mix the events of a chunk of a bin within the budget shared by the workers (thread safe).
+ * The chunk gets what is left of MaxMixSize after the chunks preceding it that are already mixed, and is skipped
+ * once nothing is left. Each chunk records its count in its own slot, no locking is needed
+ * @param ichunk Index of the chunk
+ * @param mixedPairs Output, the accepted pairs are appended
+ */
+void EventMixer::ChunkMixing(const int ichunk, std::vector<MixedPair>& mixedPairs)
+{
+    const long remaining = GetRemainingMixSize(ichunk);
+    if (remaining > 0) {
+        ChunkMixing(ichunk, mixedPairs, remaining);
+    }
+    const long mixedCount = m_mixedCount.fetch_add(mixedPairs.size(), std::memory_order_relaxed) + mixedPairs.size();
+    m_chunkMixedCount[ichunk] = mixedPairs.size();
+    std::cout << "Mixed size: " << std::min<long>(mixedCount, m_maxMixSize) << "/" << m_maxMixSize << "\r" << std::flush;
+}
 
-                /*
-                float energyProton = std::sqrt(massProton * massProton + 
-                                               rowToMix.GetFloat("fPtHad") * std::cosh(rowToMix.GetFloat("fEtaHad")) * 
-                                               rowToMix.GetFloat("fPtHad") * std::cosh(rowToMix.GetFloat("fEtaHad")));              
-
-                float px = currentRow.GetFloat("fPtHe3") * std::cos(currentRow.GetFloat("fPhiHe3")) + 
-                           rowToMix.GetFloat("fPtHad") * std::cos(rowToMix.GetFloat("fPhiHad"));
-                float py = currentRow.GetFloat("fPtHe3") * std::sin(currentRow.GetFloat("fPhiHe3")) + 
-                           rowToMix.GetFloat("fPtHad") * std::sin(rowToMix.GetFloat("fPhiHad"));
-                float pz = currentRow.GetFloat("fPtHe3") * std::sinh(currentRow.GetFloat("fEtaHe3")) + 
-                           rowToMix.GetFloat("fPtHad") * std::sinh(rowToMix.GetFloat("fEtaHad"));               
-
-                float invariantMass = std::sqrt((energyHe3 + energyProton) * (energyHe3 + energyProton) - 
-                                                px * px - py * py - pz * pz);
-                
-                if (invariantMass > 4.15314) {
-                    continue;
-                }
-                */
-                for (auto & column: m_secondElementColumns) {
-                    mixedRow[column] = rowToMix[column];
-                }
-                {
-                    std::lock_guard<std::mutex> lock(m_mutex); // Lock the mutex
-                    m_mixedArray.push_back(mixedRow);
-                    currentlyMixed++;
-                    if (m_mixedArray.size() % 100000 == 0) {
-                        std::cout << "Mixed size: " << m_mixedArray.size() << "/" << m_maxMixSize << "\r" << std::flush;
-                    }
-                    if (m_mixedArray.size() >= m_maxMixSize) {
-                        return;
-                    }
+/**
+ * @brief Mix the events of a chunk of a bin into a per-chunk buffer (thread safe).
+ * Chunks of the same bin can be mixed concurrently, the buffers are merged in order by MergeMixedBins
+ * @param ichunk Index of the chunk
+ */
+void EventMixer::ChunkMixingBuffered(const int ichunk)
+{
+    std::vector<MixedPair> mixedPairs;
+    ChunkMixing(ichunk, mixedPairs);
+    m_chunkMixedPairs[ichunk] = std::move(mixedPairs);
+}
+
+/**
+ * @brief Budget left to a chunk by the chunks preceding it that are already mixed.
+ * Chunks still being mixed are not counted, so the budget is never underestimated: the output merged in order
+ * is the same for any scheduling of the chunks
+ */
+long EventMixer::GetRemainingMixSize(const int ichunk) const
+{
+    long remaining = m_maxMixSize;
+    for (int jchunk = 0; jchunk < ichunk && remaining > 0; jchunk++) {
+        remaining -= m_chunkMixedCount[jchunk].load(std::memory_order_relaxed);
+    }
+    return remaining;
+}
+
+/**
+ * @brief Merge the per-chunk buffers of the parallel mixing in bin order, up to MaxMixSize pairs.
+ * To be called once all the workers are done
+ */
+void EventMixer::MergeMixedBins()
+{
+    for (size_t ibin = 0; ibin + 1 < m_binChunkIndex.size(); ibin++)
+    {
+        size_t nStored = 0;
+        for (int ichunk = m_binChunkIndex[ibin]; ichunk < m_binChunkIndex[ibin + 1]; ichunk++)
+        {
+            for (const auto& pair: m_chunkMixedPairs[ichunk]) {
+                if (GetMixedSize() >= m_maxMixSize) {
+                    break;
                 }
+                AddMixedPair(pair.first, pair.second);
+                nStored++;
             }
+            std::vector<MixedPair>().swap(m_chunkMixedPairs[ichunk]);
         }
+        m_mixedBinIndex[ibin+1] = nStored + m_mixedBinIndex[ibin];
     }
-    {
-        std::lock_guard<std::mutex> lock(m_mutex); // Lock the mutex
-        m_mixedBinIndex[ibin+1] = currentlyMixed + m_mixedBinIndex[ibin];
+    std::cout << std::endl << "Merged mixed size: " << GetMixedSize() << "/" << m_maxMixSize << std::endl;
+}
+
+/**
+ * @brief Store a mixed pair, either as indices or as a materialized row
+ * @param first Index in the sorted array of the event providing the first element
+ * @param second Index in the sorted array of the event providing the second element
+ */
+void EventMixer::AddMixedPair(const int first, const int second)
+{
+    if (m_storeMixedPairs) {
+        m_mixedPairs.push_back({first, second});
+    } else {
+        m_mixedArray.PushBackMixed(m_sortedArray, first, second, m_secondElementMask);
     }
 }
 
@@ -401,49 +1049,36 @@ void EventMixer::SaveMixedTree(TFile * outputFile, const char * treeName = "Mixe
 {
     //ROOT::EnableImplicitMT(m_nThreads);
 
-    std::cout << "Freeing sorted array" << std::endl;
-    m_sortedArray.clear();
+    // index pairs are gathered from the sorted array at write time
+    if (!m_storeMixedPairs) {
+        std::cout << "Freeing sorted array" << std::endl;
+        m_sortedArray.Clear();
+    }
+    ColumnStore& outputArray = m_storeMixedPairs ? m_sortedArray : m_mixedArray;
 
     outputFile->cd();
     TTree * outputTree = new TTree(treeName, treeName);
-
-    Row mixedRow;
-    mixedRow.InitRowFromDict(m_columnDict);
-    mixedRow.CreateBranchesFromDict(outputTree, m_columnDict);
+    outputArray.CreateBranches(outputTree);
 
     std::cout << "Saving mixed tree" << std::endl;
-    // checking purpose
-    const float massHe3 = physics::massHe3;
-    const float massProton = physics::massProton;
-    //
 
-    for (auto& row: m_mixedArray)
+    for (size_t irow = 0; irow < GetMixedSize(); irow++)
     {
-        mixedRow = row;
-        
-        float energyHe3 = std::sqrt(massHe3 * massHe3 + 
-                                            mixedRow.GetFloat("fPtHe3") * std::cosh(mixedRow.GetFloat("fEtaHe3")) * 
-                                            mixedRow.GetFloat("fPtHe3") * std::cosh(mixedRow.GetFloat("fEtaHe3")));
-
-        float energyProton = std::sqrt(massProton * massProton + 
-                                       mixedRow.GetFloat("fPtHad") * std::cosh(mixedRow.GetFloat("fEtaHad")) * 
-                                       mixedRow.GetFloat("fPtHad") * std::cosh(mixedRow.GetFloat("fEtaHad")));              
-
-        float px = mixedRow.GetFloat("fPtHe3") * std::cos(mixedRow.GetFloat("fPhiHe3")) + 
-                   mixedRow.GetFloat("fPtHad") * std::cos(mixedRow.GetFloat("fPhiHad"));
-        float py = mixedRow.GetFloat("fPtHe3") * std::sin(mixedRow.GetFloat("fPhiHe3")) + 
-                   mixedRow.GetFloat("fPtHad") * std::sin(mixedRow.GetFloat("fPhiHad"));
-        float pz = mixedRow.GetFloat("fPtHe3") * std::sinh(mixedRow.GetFloat("fEtaHe3")) + 
-                   mixedRow.GetFloat("fPtHad") * std::sinh(mixedRow.GetFloat("fEtaHad"));               
-
-        float invariantMass = std::sqrt((energyHe3 + energyProton) * (energyHe3 + energyProton) - 
-                                        px * px - py * py - pz * pz);
+        size_t first = irow, second = irow;
+        if (m_storeMixedPairs) {
+            first = m_mixedPairs[irow].first;
+            second = m_mixedPairs[irow].second;
+            m_sortedArray.LoadStaged(first, second, m_secondElementMask);
+        } else {
+            m_mixedArray.LoadStaged(irow);
+        }
         
-        if (invariantMass > 4.15314) {
+        // checking purpose
+        if (!m_pairSelection.IsSelected(outputArray, first, second)) {
             std::cout << "input row: " << std::endl;
-            mixedRow.Print();
+            outputArray[first].Print();
             std::cout << "mixed row: " << std::endl;
-            mixedRow.Print();
+            outputArray[second].Print();
         }
         outputTree->Fill();
     }
@@ -453,6 +1088,83 @@ void EventMixer::SaveMixedTree(TFile * outputFile, const char * treeName = "Mixe
     //ROOT::DisableImplicitMT();
 }
 
+/**
+ * @brief Out-of-core mixing: the bins are read from their spill files and mixed by nWorkers workers, each bin
+ * in its own store, while the mixed events of the preceding bin are written to the output tree.
+ * At most nWorkers bins are in memory besides the one being written. Bins are written in bin order and bins are
+ * not split in chunks, so the output is the same as for the in-memory mixing
+ * @return Number of mixed entries written, at most MaxMixSize
+ */
+long EventMixer::OutOfCoreMixing(TTree * outputTree, const int nWorkers)
+{
+    m_spill->Flush();
+    const int nMixingBins = m_binningHist.GetOverflowBin();         // events in the overflow bin are never selected
+    for (int ibin = 0; ibin < m_binningHist.GetNBins(); ibin++) {
+        m_binningHist.SetBinContent(ibin, m_spill->GetBinSize(ibin));
+    }
+    if (m_chunkSize > 0) {
+        std::cerr << "Out-of-core mixing: ChunkSize is ignored, the bins are mixed whole" << std::endl;
+    }
+    if (nWorkers > 1) {
+        ROOT::EnableThreadSafety();
+    }
+
+    // events of a bin, read and mixed by a worker
+    struct MixedBin
+    {
+        ColumnStore store;
+        std::vector<MixedPair> mixedPairs;
+    };
+    auto mixBin = [this] (const int ibin, const size_t maxPairs) {
+        MixedBin mixedBin;
+        InitStore(mixedBin.store);
+        mixedBin.store.Reserve(m_spill->GetBinSize(ibin));
+        m_spill->ReadBin(ibin, mixedBin.store);
+        if (maxPairs > 0) {
+            MixEvents(mixedBin.store, 0, 0, mixedBin.store.GetSize(), mixedBin.mixedPairs, maxPairs);
+        }
+        return mixedBin;
+    };
+
+    m_sortedArray.Clear();
+    m_sortedArray.CreateBranches(outputTree);
+    size_t nEntries = 0;
+    int nextBin = 0;
+    // the budget of a bin is what is left when it is started: never less than what is actually left once
+    // the preceding bins are written, the extra pairs are not written
+    std::deque<std::future<MixedBin>> pendingBins;
+    auto startBins = [&] () {
+        for (; nextBin < nMixingBins && (int)pendingBins.size() < std::max(nWorkers, 1); nextBin++) {
+            pendingBins.push_back(std::async(std::launch::async, mixBin, nextBin, m_maxMixSize - nEntries));
+        }
+    };
+    startBins();
+    while (!pendingBins.empty() && nEntries < m_maxMixSize)
+    {
+        MixedBin mixedBin = pendingBins.front().get();
+        pendingBins.pop_front();
+        startBins();
+
+        mixedBin.store.SetBranchAddresses(outputTree);
+        for (const auto& pair: mixedBin.mixedPairs)
+        {
+            if (nEntries >= m_maxMixSize) {
+                break;
+            }
+            mixedBin.store.LoadStaged(pair.first, pair.second, m_secondElementMask);
+            outputTree->Fill();
+            nEntries++;
+        }
+        std::cout << "Mixed size: " << nEntries << "/" << m_maxMixSize << "\r" << std::flush;
+    }
+    for (auto & pendingBin : pendingBins) {
+        pendingBin.wait();
+    }
+    std::cout << std::endl;
+    m_sortedArray.SetBranchAddresses(outputTree);
+    return nEntries;
+}
+
 void EventMixer::Print()
 {
     std::cout << "----------------------------------------" << std::endl;
@@ -462,9 +1174,12 @@ void EventMixer::Print()
     std::cout << "Number of bins: " << GetNBins() << std::endl;
     std::cout << "Buffer size: " << m_bufferSize << std::endl;
     std::cout << "Number of threads: " << m_nThreads << std::endl;
-    std::cout << "Binning variables: " << m_binVariableX << ", " << m_binVariableY << std::endl;
-    std::cout << "X Binning: " << m_binningHist.GetNBinsX() << " bins, in [" << m_binningHist.GetXmin() << ", " << m_binningHist.GetXmax() << "]" << std::endl;
-    std::cout << "Y Binning: " << m_binningHist.GetNBinsY() << " bins, in [" << m_binningHist.GetYmin() << ", " << m_binningHist.GetYmax() << "]" << std::endl;
+    std::cout << "Binning variables:";
+    for (const auto& variable: m_binVariables) {
+        std::cout << " " << variable;
+    }
+    std::cout << std::endl;
+    m_binningHist.Print();
     std::cout << "Mixing exclusion variable: " << m_mixingExclusionVariable << std::endl;
     std::cout << "----------------------------------------" << std::endl;
     std::cout << std::endl;
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HISTND_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Axis with uniform or variable bin edges. Bins are [edge_i, edge_i+1), the last one also includes the upper edge.
+ * The bin of a value is found with a lookup table over a uniform grid finer than the narrowest bin:
+ * the cell of the value gives the bin up to one position, fixed by two comparisons without branches
+ */
+class BinAxis
+{
+    public:
+        BinAxis() = default;
+        BinAxis(const int nBins, const float min, const float max);
+        BinAxis(const std::vector<float>& edges);
+
+        int GetNBins() const { return (int)m_edges.size() - 1; }
+        float GetMin() const { return m_edges.front(); }
+        float GetMax() const { return m_edges.back(); }
+        const std::vector<float>& GetEdges() const { return m_edges; }
+        bool IsUniform() const { return m_uniform; }
+        int FindBin(const float x) const;
+        void FindBins(const float* x, const size_t n, int* bins) const;
+
+    private:
+        void BuildLookupTable();
+#ifdef HISTND_X86_SIMD
+        __attribute__((target("avx2")))
+        void FindBinsAVX2(const float* x, const size_t n, int* bins) const;
+#endif
+
+        static constexpr int kMaxCells = 1 << 20;
+
+        std::vector<float> m_edges;
+        bool m_uniform = false;
+        std::vector<int> m_lookupTable;                 // bin of the lower boundary of each cell
+        float m_cellScale;                              // number of cells per unit
+};
+
+BinAxis::BinAxis(const int nBins, const float min, const float max): m_uniform(true)
+{
+    if (nBins < 1 || !(max > min)) {
+        throw std::invalid_argument("BinAxis: invalid uniform binning");
+    }
+    m_edges.resize(nBins + 1);
+    for (int ibin = 0; ibin <= nBins; ibin++) {
+        m_edges[ibin] = min + (max - min) * ibin / nBins;
+    }
+    BuildLookupTable();
+}
+
+BinAxis::BinAxis(const std::vector<float>& edges): m_edges(edges)
+{
+    if (m_edges.size() < 2 || !std::is_sorted(m_edges.begin(), m_edges.end()) ||
+        std::adjacent_find(m_edges.begin(), m_edges.end()) != m_edges.end()) {
+        throw std::invalid_argument("BinAxis: bin edges must be at least two and strictly increasing");
+    }
+    BuildLookupTable();
+}
+
+void BinAxis::BuildLookupTable()
+{
+    float minWidth = GetMax() - GetMin();
+    for (int ibin = 0; ibin < GetNBins(); ibin++) {
+        minWidth = std::min(minWidth, m_edges[ibin + 1] - m_edges[ibin]);
+    }
+    // cells at most half as wide as the narrowest bin: a cell overlaps at most two bins
+    const double nCells = 2. * std::ceil((GetMax() - GetMin()) / minWidth);
+    if (nCells > kMaxCells) {
+        throw std::invalid_argument("BinAxis: bins too narrow with respect to the axis range");
+    }
+    m_lookupTable.resize(std::max(static_cast<int>(nCells), GetNBins()));
+    m_cellScale = m_lookupTable.size() / (GetMax() - GetMin());
+
+    int bin = 0;
+    for (size_t icell = 0; icell < m_lookupTable.size(); icell++)
+    {
+        const float lowerBoundary = GetMin() + icell / m_cellScale;
+        while (bin + 1 < GetNBins() && lowerBoundary >= m_edges[bin + 1]) {
+            bin++;
+        }
+        m_lookupTable[icell] = bin;
+    }
+}
+
+/**
+ * @brief Bin of a value, -1 if outside [min, max] (or NaN)
+ */
+int BinAxis::FindBin(const float x) const
+{
+    if (!(x >= GetMin() && x <= GetMax())) {
+        return -1;
+    }
+    const int icell = std::min(static_cast<int>((x - GetMin()) * m_cellScale), (int)m_lookupTable.size() - 1);
+    int bin = m_lookupTable[icell];
+    bin -= (x < m_edges[bin]);                      // rounding of the cell boundaries
+    bin += (bin + 1 < GetNBins()) & (x >= m_edges[bin + 1]);
+    return bin;
+}
+
+/**
+ * @brief Bins of n values at once, -1 for the values outside [min, max]. Same result as FindBin,
+ * eight values at a time if the CPU supports AVX2
+ */
+void BinAxis::FindBins(const float* x, const size_t n, int* bins) const
+{
+#ifdef HISTND_X86_SIMD
+    static const bool hasAVX2 = __builtin_cpu_supports("avx2");
+    if (hasAVX2) {
+        FindBinsAVX2(x, n, bins);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) {
+        bins[i] = FindBin(x[i]);
+    }
+}
+
+#ifdef HISTND_X86_SIMD
+__attribute__((target("avx2")))
+void BinAxis::FindBinsAVX2(const float* x, const size_t n, int* bins) const
+{
+    const __m256 min = _mm256_set1_ps(GetMin()), max = _mm256_set1_ps(GetMax()), scale = _mm256_set1_ps(m_cellScale);
+    const __m256i lastCell = _mm256_set1_epi32((int)m_lookupTable.size() - 1);
+    const __m256i lastBin = _mm256_set1_epi32(GetNBins() - 1);
+    const __m256i one = _mm256_set1_epi32(1), outOfRange = _mm256_set1_epi32(-1);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 values = _mm256_loadu_ps(x + i);
+        const __m256 inRange = _mm256_and_ps(_mm256_cmp_ps(values, min, _CMP_GE_OQ), _mm256_cmp_ps(values, max, _CMP_LE_OQ));
+        values = _mm256_blendv_ps(min, values, inRange); // values out of range (or NaN) are looked up as min, then discarded
+        const __m256i cell = _mm256_min_epi32(_mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(values, min), scale)), lastCell);
+        __m256i bin = _mm256_i32gather_epi32(m_lookupTable.data(), cell, 4);
+        // comparison masks are -1 where true
+        const __m256 lowerEdge = _mm256_i32gather_ps(m_edges.data(), bin, 4);
+        bin = _mm256_add_epi32(bin, _mm256_castps_si256(_mm256_cmp_ps(values, lowerEdge, _CMP_LT_OQ)));
+        const __m256 upperEdge = _mm256_i32gather_ps(m_edges.data(), _mm256_add_epi32(bin, one), 4);
+        bin = _mm256_sub_epi32(bin, _mm256_and_si256(_mm256_cmpgt_epi32(lastBin, bin), _mm256_castps_si256(_mm256_cmp_ps(values, upperEdge, _CMP_GE_OQ))));
+        bin = _mm256_blendv_epi8(outOfRange, bin, _mm256_castps_si256(inRange));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(bins + i), bin);
+    }
+    for (; i < n; i++) {
+        bins[i] = FindBin(x[i]);
+    }
+}
+#endif
+
+/**
+ * @brief N-dimensional histogram with integer counts, used to define the mixing classes.
+ * Global bins are ordered with the first axis varying slowest. The last bin is the overflow bin,
+ * collecting the values outside the range of any axis
+ */
+class HistND
+{
+    public:
+        HistND() = default;
+        HistND(const std::vector<BinAxis>& axes);
+
+        int GetNDimensions() const { return (int)m_axes.size(); }
+        const BinAxis& GetAxis(const int iaxis) const { return m_axes[iaxis]; }
+        /**
+         * @brief Get the total number of bins. The last bin is the overflow bin.
+        */
+        int GetNBins() const { return (int)m_counts.size(); }
+        int GetOverflowBin() const { return (int)m_counts.size() - 1; }
+        int GetBin(const float* values) const;
+        void GetBins(const std::vector<const float*>& values, const size_t n, int* bins) const;
+        long GetBinContent(const int bin) const { return m_counts[bin]; }
+        const std::vector<long>& GetData() const { return m_counts; }
+        bool IsUnderflow(const float* values) const { return GetBin(values) == GetOverflowBin(); }
+
+        void Fill(const float* values) { m_counts[GetBin(values)]++; }
+        void SetBinContent(const int bin, const long content) { m_counts[bin] = content; }
+        void Print() const;
+
+    private:
+        std::vector<BinAxis> m_axes;
+        std::vector<int> m_strides;                     // global bin = sum of axis bin x stride
+        std::vector<long> m_counts;
+};
+
+HistND::HistND(const std::vector<BinAxis>& axes): m_axes(axes)
+{
+    m_strides.resize(m_axes.size());
+    int nBins = 1;
+    for (int iaxis = (int)m_axes.size() - 1; iaxis >= 0; iaxis--) {
+        m_strides[iaxis] = nBins;
+        nBins *= m_axes[iaxis].GetNBins();
+    }
+    m_counts.assign(nBins + 1, 0); // +1 for overflow and underflow bin
+}
+
+/**
+ * @brief Global bin of a point (one value per axis), the overflow bin if outside the range of any axis
+ */
+int HistND::GetBin(const float* values) const
+{
+    int bin = 0;
+    bool inRange = true;
+    for (size_t iaxis = 0; iaxis < m_axes.size(); iaxis++) {
+        const int axisBin = m_axes[iaxis].FindBin(values[iaxis]);
+        inRange &= axisBin >= 0;
+        bin += axisBin * m_strides[iaxis];
+    }
+    return inRange ? bin : GetOverflowBin();
+}
+
+/**
+ * @brief Global bins of n points at once
+ * @param values One array of n values per axis
+ * @param bins Output, global bin of each point (the overflow bin if outside the range of any axis)
+ */
+void HistND::GetBins(const std::vector<const float*>& values, const size_t n, int* bins) const
+{
+    std::vector<int> axisBins(n);
+    std::fill(bins, bins + n, 0);
+    for (size_t iaxis = 0; iaxis < m_axes.size(); iaxis++)
+    {
+        m_axes[iaxis].FindBins(values[iaxis], n, axisBins.data());
+        const int stride = m_strides[iaxis];
+        for (size_t i = 0; i < n; i++) {
+            bins[i] = (bins[i] < 0 || axisBins[i] < 0) ? -1 : bins[i] + axisBins[i] * stride;
+        }
+    }
+    const int overflowBin = GetOverflowBin();
+    for (size_t i = 0; i < n; i++) {
+        bins[i] = bins[i] < 0 ? overflowBin : bins[i];
+    }
+}
+
+void HistND::Print() const
+{
+    for (size_t iaxis = 0; iaxis < m_axes.size(); iaxis++)
+    {
+        const BinAxis& axis = m_axes[iaxis];
+        std::cout << "Axis " << iaxis << ": " << axis.GetNBins() << " bins, in [" << axis.GetMin() << ", " << axis.GetMax() << "]";
+        if (!axis.IsUniform()) {
+            std::cout << ", edges:";
+            for (const float edge: axis.GetEdges()) {
+                std::cout << " " << edge;
+            }
+        }
+        std::cout << std::endl;
+    }
+}
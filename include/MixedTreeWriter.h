@@ -0,0 +1,161 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+#include <TTree.h>
+#include <TROOT.h>
+
+#include "ColumnStore.h"
+
+/**
+ * @brief Mixed pair stored as indices of the two events in the sorted array
+ */
+struct MixedPair
+{
+    int first;                                      // event providing all the columns but the second element ones
+    int second;                                     // event providing the second element columns
+};
+
+/**
+ * @brief Writer stage of the streaming mixer.
+ * Mixed bins (or chunks of bins) are handed over as index pairs and written to the output tree by a dedicated thread,
+ * while the other bins are still being mixed. Bins are written in bin order, so the output is the same
+ * as the one of the sequential mixing. At most maxEntries entries are written.
+ * Bins are pushed at most maxPendingBins ahead of the one being written (see WaitForSlot), which bounds the memory
+ * of the pairs waiting to be written. Every bin in [0, nBins) has to be pushed (also if empty). If the mixing fails before, Abort() (or Close(), also
+ * called when the writer is destroyed during stack unwinding) stops the writer thread at the first missing bin
+ */
+class MixedTreeWriter
+{
+    public:
+        MixedTreeWriter(TTree* outputTree, ColumnStore& sortedArray, const std::vector<bool>& secondElementMask, const int nBins, const long maxEntries, const int maxPendingBins);
+        ~MixedTreeWriter() { Close(); }
+
+        bool WaitForSlot(const int ibin);
+        void Push(const int ibin, std::vector<MixedPair>&& mixedPairs);
+        void Close();
+        void Abort();
+        long GetNEntries() const { return m_nEntries; }
+
+    private:
+        void Run();
+
+        TTree* m_outputTree;
+        ColumnStore& m_sortedArray;                     // events the pairs point to. Only the staging row is modified
+        std::vector<bool> m_secondElementMask;          // flag the store columns taken from the second element
+
+        std::mutex m_mutex;
+        std::condition_variable m_condition;
+        std::map<int, std::vector<MixedPair>> m_pendingBins; // mixed bins waiting to be written
+        int m_nextBin;                                  // next bin to be written
+        int m_maxPendingBins;                           // bins mixed ahead of the one being written
+        int m_nPushed;                                  // bins handed over so far
+        bool m_aborted;                                 // the missing bins will never be pushed, stop writing
+        int m_nBins;
+        long m_maxEntries;
+        long m_nEntries;                                // entries written so far
+        std::thread m_thread;
+};
+
+MixedTreeWriter::MixedTreeWriter(TTree* outputTree, ColumnStore& sortedArray, const std::vector<bool>& secondElementMask, const int nBins, const long maxEntries, const int maxPendingBins):
+    m_outputTree(outputTree), m_sortedArray(sortedArray), m_secondElementMask(secondElementMask), m_nextBin(0), m_maxPendingBins(std::max(maxPendingBins, 1)), m_nPushed(0), m_aborted(false), m_nBins(nBins), m_maxEntries(maxEntries), m_nEntries(0)
+{
+    ROOT::EnableThreadSafety();
+    m_sortedArray.CreateBranches(m_outputTree);
+    m_thread = std::thread(&MixedTreeWriter::Run, this);
+}
+
+/**
+ * @brief Back-pressure for the mixing workers: wait until bin ibin is less than maxPendingBins bins ahead of the one
+ * being written (thread safe). Bins have to be mixed in bin order, so that the bin being written is always mixed
+ * by some worker
+ * @return false if the writer was aborted, the bin does not need to be mixed
+ */
+bool MixedTreeWriter::WaitForSlot(const int ibin)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_condition.wait(lock, [&]() { return m_aborted || ibin < m_nextBin + m_maxPendingBins; });
+    return !m_aborted;
+}
+
+/**
+ * @brief Hand over a mixed bin to the writer (thread safe)
+ */
+void MixedTreeWriter::Push(const int ibin, std::vector<MixedPair>&& mixedPairs)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pendingBins[ibin] = std::move(mixedPairs);
+        m_nPushed++;
+    }
+    m_condition.notify_all();
+}
+
+/**
+ * @brief Wait until all the bins are written. If not all the bins were pushed, the writer is aborted instead
+ * of waiting for them
+ */
+void MixedTreeWriter::Close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_aborted |= m_nPushed < m_nBins;
+    }
+    m_condition.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+/**
+ * @brief Stop writing at the first bin not pushed yet, e.g. when a mixing worker failed (thread safe)
+ */
+void MixedTreeWriter::Abort()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_aborted = true;
+    }
+    m_condition.notify_all();
+}
+
+void MixedTreeWriter::Run()
+{
+    while (m_nextBin < m_nBins)
+    {
+        std::vector<MixedPair> mixedPairs;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [&]() { return m_aborted || m_pendingBins.find(m_nextBin) != m_pendingBins.end(); });
+            auto it = m_pendingBins.find(m_nextBin);
+            if (it == m_pendingBins.end()) {
+                break;
+            }
+            mixedPairs = std::move(it->second);
+            m_pendingBins.erase(it);
+        }
+
+        for (const auto& pair: mixedPairs)
+        {
+            if (m_nEntries >= m_maxEntries) {
+                break;
+            }
+            m_sortedArray.LoadStaged(pair.first, pair.second, m_secondElementMask);
+            m_outputTree->Fill();
+            m_nEntries++;
+        }
+        std::cout << "Written bin " << m_nextBin << "/" << m_nBins << ", entries: " << m_nEntries << "\r" << std::flush;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_nextBin++;
+        }
+        m_condition.notify_all();
+    }
+    std::cout << std::endl;
+}
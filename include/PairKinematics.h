@@ -0,0 +1,244 @@
+#pragma once
+
+#include <cmath>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define PAIRKINEMATICS_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Read-only view of the four-momentum components of a set of tracks, one array per component
+ */
+struct FourMomentumArrays
+{
+    const float* e;
+    const float* px;
+    const float* py;
+    const float* pz;
+};
+
+/**
+ * @brief Windows of the pair cuts. A pair is rejected if a quantity is outside the window of an enabled cut,
+ * comparisons involving NaN do not reject
+ */
+struct PairCuts
+{
+    bool useMass = false;
+    float massMin, massMax;                         // invariant mass window [GeV/c^2]
+    bool useKstar = false;
+    float kstarMin, kstarMax;                       // window of the relative momentum in the pair rest frame [GeV/c]
+    float massSum2, massDiff2;                      // (m1 + m2)^2 and (m1 - m2)^2 of the mass hypotheses
+    bool useAngle = false;
+    float cosAngleMin, cosAngleMax;                 // window of the cosine of the opening angle
+};
+
+/**
+ * @brief Pair kernels: one track against many others, gathered by index.
+ * A kernel is instantiated for each combination of enabled cuts, so disabled cuts cost nothing and the enabled ones
+ * are combined in a single pass without branches. The AVX-512 or AVX2 version is chosen at run time
+ * from the CPU features, with a scalar fallback
+ */
+namespace PairKinematics
+{
+    using PairCutKernel = void (*)(const FourMomentumArrays&, const int, const FourMomentumArrays&,
+                                   const int*, const int, const PairCuts&, unsigned char*);
+
+    /**
+     * @brief Compute the four-momenta of n tracks from (pt, eta, phi) under a mass hypothesis
+     */
+    void ComputeFourMomenta(const float* pt, const float* eta, const float* phi, const size_t n, const float mass,
+                            float* e, float* px, float* py, float* pz)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            e[i] = std::sqrt(mass * mass + pt[i] * std::cosh(eta[i]) * pt[i] * std::cosh(eta[i]));
+            px[i] = pt[i] * std::cos(phi[i]);
+            py[i] = pt[i] * std::sin(phi[i]);
+            pz[i] = pt[i] * std::sinh(eta[i]);
+        }
+    }
+
+    /**
+     * @brief Accept mask of the pairs made of the track first[ifirst] and each track second[indices[i]]
+     * @param accept Output, accept[i] = 1 if the i-th pair passes all the enabled cuts, 0 otherwise
+     */
+    template <bool kMass, bool kKstar, bool kAngle>
+    void PairCutMaskScalar(const FourMomentumArrays& first, const int ifirst, const FourMomentumArrays& second,
+                           const int* indices, const int n, const PairCuts& cuts, unsigned char* accept)
+    {
+        const float e = first.e[ifirst], px = first.px[ifirst], py = first.py[ifirst], pz = first.pz[ifirst];
+        const float p = std::sqrt(px * px + py * py + pz * pz);
+        for (int i = 0; i < n; i++)
+        {
+            const int j = indices[i];
+            bool selected = true;
+            const float pairE = e + second.e[j];
+            const float pairPx = px + second.px[j];
+            const float pairPy = py + second.py[j];
+            const float pairPz = pz + second.pz[j];
+            const float mass2 = pairE * pairE - pairPx * pairPx - pairPy * pairPy - pairPz * pairPz;
+            if constexpr (kMass) {
+                const float invariantMass = std::sqrt(mass2);
+                selected &= !(invariantMass < cuts.massMin) & !(invariantMass > cuts.massMax);
+            }
+            if constexpr (kKstar) {
+                const float kstar = std::sqrt((mass2 - cuts.massSum2) * (mass2 - cuts.massDiff2) / (4.f * mass2));
+                selected &= !(kstar < cuts.kstarMin) & !(kstar > cuts.kstarMax);
+            }
+            if constexpr (kAngle) {
+                const float dot = px * second.px[j] + py * second.py[j] + pz * second.pz[j];
+                const float cosAngle = dot / (p * std::sqrt(second.px[j] * second.px[j] + second.py[j] * second.py[j] + second.pz[j] * second.pz[j]));
+                selected &= !(cosAngle < cuts.cosAngleMin) & !(cosAngle > cuts.cosAngleMax);
+            }
+            accept[i] = selected;
+        }
+    }
+
+#ifdef PAIRKINEMATICS_X86_SIMD
+    template <bool kMass, bool kKstar, bool kAngle>
+    __attribute__((target("avx2")))
+    void PairCutMaskAVX2(const FourMomentumArrays& first, const int ifirst, const FourMomentumArrays& second,
+                         const int* indices, const int n, const PairCuts& cuts, unsigned char* accept)
+    {
+        const float p = std::sqrt(first.px[ifirst] * first.px[ifirst] + first.py[ifirst] * first.py[ifirst] + first.pz[ifirst] * first.pz[ifirst]);
+        const __m256 e1 = _mm256_set1_ps(first.e[ifirst]), px1 = _mm256_set1_ps(first.px[ifirst]);
+        const __m256 py1 = _mm256_set1_ps(first.py[ifirst]), pz1 = _mm256_set1_ps(first.pz[ifirst]);
+        const __m256 p1 = _mm256_set1_ps(p);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            const __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(indices + i));
+            const __m256 e2 = _mm256_i32gather_ps(second.e, index, 4);
+            const __m256 px2 = _mm256_i32gather_ps(second.px, index, 4);
+            const __m256 py2 = _mm256_i32gather_ps(second.py, index, 4);
+            const __m256 pz2 = _mm256_i32gather_ps(second.pz, index, 4);
+            const __m256 pairE = _mm256_add_ps(e1, e2);
+            const __m256 pairPx = _mm256_add_ps(px1, px2);
+            const __m256 pairPy = _mm256_add_ps(py1, py2);
+            const __m256 pairPz = _mm256_add_ps(pz1, pz2);
+            __m256 mass2 = _mm256_mul_ps(pairE, pairE);
+            mass2 = _mm256_sub_ps(mass2, _mm256_mul_ps(pairPx, pairPx));
+            mass2 = _mm256_sub_ps(mass2, _mm256_mul_ps(pairPy, pairPy));
+            mass2 = _mm256_sub_ps(mass2, _mm256_mul_ps(pairPz, pairPz));
+
+            // ordered comparisons: NaN values do not reject, as in the scalar version
+            __m256 rejected = _mm256_setzero_ps();
+            if constexpr (kMass) {
+                const __m256 invariantMass = _mm256_sqrt_ps(mass2);
+                rejected = _mm256_or_ps(rejected, _mm256_cmp_ps(invariantMass, _mm256_set1_ps(cuts.massMin), _CMP_LT_OQ));
+                rejected = _mm256_or_ps(rejected, _mm256_cmp_ps(invariantMass, _mm256_set1_ps(cuts.massMax), _CMP_GT_OQ));
+            }
+            if constexpr (kKstar) {
+                const __m256 numerator = _mm256_mul_ps(_mm256_sub_ps(mass2, _mm256_set1_ps(cuts.massSum2)), _mm256_sub_ps(mass2, _mm256_set1_ps(cuts.massDiff2)));
+                const __m256 kstar = _mm256_sqrt_ps(_mm256_div_ps(numerator, _mm256_mul_ps(_mm256_set1_ps(4.f), mass2)));
+                rejected = _mm256_or_ps(rejected, _mm256_cmp_ps(kstar, _mm256_set1_ps(cuts.kstarMin), _CMP_LT_OQ));
+                rejected = _mm256_or_ps(rejected, _mm256_cmp_ps(kstar, _mm256_set1_ps(cuts.kstarMax), _CMP_GT_OQ));
+            }
+            if constexpr (kAngle) {
+                __m256 dot = _mm256_mul_ps(px1, px2);
+                dot = _mm256_add_ps(dot, _mm256_mul_ps(py1, py2));
+                dot = _mm256_add_ps(dot, _mm256_mul_ps(pz1, pz2));
+                __m256 p2 = _mm256_mul_ps(px2, px2);
+                p2 = _mm256_add_ps(p2, _mm256_mul_ps(py2, py2));
+                p2 = _mm256_add_ps(p2, _mm256_mul_ps(pz2, pz2));
+                const __m256 cosAngle = _mm256_div_ps(dot, _mm256_mul_ps(p1, _mm256_sqrt_ps(p2)));
+                rejected = _mm256_or_ps(rejected, _mm256_cmp_ps(cosAngle, _mm256_set1_ps(cuts.cosAngleMin), _CMP_LT_OQ));
+                rejected = _mm256_or_ps(rejected, _mm256_cmp_ps(cosAngle, _mm256_set1_ps(cuts.cosAngleMax), _CMP_GT_OQ));
+            }
+            const int rejectedBits = _mm256_movemask_ps(rejected);
+            for (int k = 0; k < 8; k++) {
+                accept[i + k] = !((rejectedBits >> k) & 1);
+            }
+        }
+        PairCutMaskScalar<kMass, kKstar, kAngle>(first, ifirst, second, indices + i, n - i, cuts, accept + i);
+    }
+
+    template <bool kMass, bool kKstar, bool kAngle>
+    __attribute__((target("avx512f")))
+    void PairCutMaskAVX512(const FourMomentumArrays& first, const int ifirst, const FourMomentumArrays& second,
+                           const int* indices, const int n, const PairCuts& cuts, unsigned char* accept)
+    {
+        const float p = std::sqrt(first.px[ifirst] * first.px[ifirst] + first.py[ifirst] * first.py[ifirst] + first.pz[ifirst] * first.pz[ifirst]);
+        const __m512 e1 = _mm512_set1_ps(first.e[ifirst]), px1 = _mm512_set1_ps(first.px[ifirst]);
+        const __m512 py1 = _mm512_set1_ps(first.py[ifirst]), pz1 = _mm512_set1_ps(first.pz[ifirst]);
+        const __m512 p1 = _mm512_set1_ps(p);
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            const __m512i index = _mm512_loadu_si512(indices + i);
+            const __m512 e2 = _mm512_i32gather_ps(index, second.e, 4);
+            const __m512 px2 = _mm512_i32gather_ps(index, second.px, 4);
+            const __m512 py2 = _mm512_i32gather_ps(index, second.py, 4);
+            const __m512 pz2 = _mm512_i32gather_ps(index, second.pz, 4);
+            const __m512 pairE = _mm512_add_ps(e1, e2);
+            const __m512 pairPx = _mm512_add_ps(px1, px2);
+            const __m512 pairPy = _mm512_add_ps(py1, py2);
+            const __m512 pairPz = _mm512_add_ps(pz1, pz2);
+            __m512 mass2 = _mm512_mul_ps(pairE, pairE);
+            mass2 = _mm512_sub_ps(mass2, _mm512_mul_ps(pairPx, pairPx));
+            mass2 = _mm512_sub_ps(mass2, _mm512_mul_ps(pairPy, pairPy));
+            mass2 = _mm512_sub_ps(mass2, _mm512_mul_ps(pairPz, pairPz));
+
+            __mmask16 rejected = 0;
+            if constexpr (kMass) {
+                const __m512 invariantMass = _mm512_sqrt_ps(mass2);
+                rejected |= _mm512_cmp_ps_mask(invariantMass, _mm512_set1_ps(cuts.massMin), _CMP_LT_OQ);
+                rejected |= _mm512_cmp_ps_mask(invariantMass, _mm512_set1_ps(cuts.massMax), _CMP_GT_OQ);
+            }
+            if constexpr (kKstar) {
+                const __m512 numerator = _mm512_mul_ps(_mm512_sub_ps(mass2, _mm512_set1_ps(cuts.massSum2)), _mm512_sub_ps(mass2, _mm512_set1_ps(cuts.massDiff2)));
+                const __m512 kstar = _mm512_sqrt_ps(_mm512_div_ps(numerator, _mm512_mul_ps(_mm512_set1_ps(4.f), mass2)));
+                rejected |= _mm512_cmp_ps_mask(kstar, _mm512_set1_ps(cuts.kstarMin), _CMP_LT_OQ);
+                rejected |= _mm512_cmp_ps_mask(kstar, _mm512_set1_ps(cuts.kstarMax), _CMP_GT_OQ);
+            }
+            if constexpr (kAngle) {
+                __m512 dot = _mm512_mul_ps(px1, px2);
+                dot = _mm512_add_ps(dot, _mm512_mul_ps(py1, py2));
+                dot = _mm512_add_ps(dot, _mm512_mul_ps(pz1, pz2));
+                __m512 p2 = _mm512_mul_ps(px2, px2);
+                p2 = _mm512_add_ps(p2, _mm512_mul_ps(py2, py2));
+                p2 = _mm512_add_ps(p2, _mm512_mul_ps(pz2, pz2));
+                const __m512 cosAngle = _mm512_div_ps(dot, _mm512_mul_ps(p1, _mm512_sqrt_ps(p2)));
+                rejected |= _mm512_cmp_ps_mask(cosAngle, _mm512_set1_ps(cuts.cosAngleMin), _CMP_LT_OQ);
+                rejected |= _mm512_cmp_ps_mask(cosAngle, _mm512_set1_ps(cuts.cosAngleMax), _CMP_GT_OQ);
+            }
+            for (int k = 0; k < 16; k++) {
+                accept[i + k] = !((rejected >> k) & 1);
+            }
+        }
+        PairCutMaskScalar<kMass, kKstar, kAngle>(first, ifirst, second, indices + i, n - i, cuts, accept + i);
+    }
+#endif
+
+    /**
+     * @brief Widest implementation of a kernel supported by the CPU
+     */
+    template <bool kMass, bool kKstar, bool kAngle>
+    PairCutKernel SelectPairCutKernel()
+    {
+#ifdef PAIRKINEMATICS_X86_SIMD
+        if (__builtin_cpu_supports("avx512f")) return PairCutMaskAVX512<kMass, kKstar, kAngle>;
+        if (__builtin_cpu_supports("avx2")) return PairCutMaskAVX2<kMass, kKstar, kAngle>;
+#endif
+        return PairCutMaskScalar<kMass, kKstar, kAngle>;
+    }
+
+    /**
+     * @brief Kernel evaluating exactly the enabled cuts
+     */
+    PairCutKernel SelectPairCutKernel(const PairCuts& cuts)
+    {
+        switch ((cuts.useMass ? 4 : 0) + (cuts.useKstar ? 2 : 0) + (cuts.useAngle ? 1 : 0)) {
+            case 0: return SelectPairCutKernel<false, false, false>();
+            case 1: return SelectPairCutKernel<false, false, true>();
+            case 2: return SelectPairCutKernel<false, true, false>();
+            case 3: return SelectPairCutKernel<false, true, true>();
+            case 4: return SelectPairCutKernel<true, false, false>();
+            case 5: return SelectPairCutKernel<true, false, true>();
+            case 6: return SelectPairCutKernel<true, true, false>();
+            default: return SelectPairCutKernel<true, true, true>();
+        }
+    }
+
+} // namespace PairKinematics
@@ -0,0 +1,229 @@
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+#include <yaml-cpp/yaml.h>
+
+#include "ColumnStore.h"
+#include "PairKinematics.h"
+#include "YamlUtils.h"
+
+/**
+ * @brief Selection of the mixed pairs, configured from YAML, e.g.
+ *      PairSelection:
+ *        FirstElement:  [ fPtHe3, fEtaHe3, fPhiHe3 ]   # pt, eta, phi columns of each element
+ *        SecondElement: [ fPtHad, fEtaHad, fPhiHad ]
+ *        MassFirst: 2.80923                            # mass hypotheses [GeV/c^2]
+ *        MassSecond: 0.938272
+ *        InvariantMass: [ 0., 4.15314 ]                # optional windows
+ *        Kstar: [ 0., 0.5 ]
+ *        OpeningAngle: [ 0., 3.1416 ]
+ * The four-momenta of the two elements are derived columns of the stores, computed once per track.
+ * Without a configuration all the pairs are accepted and no column is added
+ */
+class PairSelection
+{
+    public:
+        PairSelection() = default;
+        PairSelection(const YAML::Node& config);
+
+        bool IsEmpty() const { return !m_enabled; }
+        std::vector<std::string> GetColumnNames() const;
+        void AddDerivedColumns(ColumnStore& store) const;
+        void Resolve(const ColumnStore& store);
+        std::vector<int> GetSecondDerivedColumns() const;
+        void ComputeDerived(ColumnStore& store) const;
+        void Evaluate(const ColumnStore& store, const int first, const int* seconds, const int n, unsigned char* accept) const;
+        bool IsSelected(const ColumnStore& store, const int first, const int second) const;
+        void Print() const;
+
+    private:
+        /**
+         * @brief Handles of the input (pt, eta, phi) and derived (e, px, py, pz) columns of an element
+         */
+        struct ElementColumns
+        {
+            int pt, eta, phi;
+            int e, px, py, pz;
+        };
+
+        static std::vector<std::string> GetDerivedColumnNames(const std::string& element);
+        static void ReadWindow(const YAML::Node& node, bool& use, float& min, float& max);
+        void ComputeDerived(ColumnStore& store, const ElementColumns& columns, const float mass) const;
+        FourMomentumArrays GetMomenta(const ColumnStore& store, const ElementColumns& columns) const;
+
+        bool m_enabled = false;
+        std::vector<std::string> m_firstColumns;        // pt, eta, phi columns of the first element
+        std::vector<std::string> m_secondColumns;       // pt, eta, phi columns of the second element
+        float m_massFirst, m_massSecond;                // mass hypotheses
+        ElementColumns m_first, m_second;
+        PairCuts m_cuts;
+        PairKinematics::PairCutKernel m_kernel = nullptr;
+};
+
+PairSelection::PairSelection(const YAML::Node& config)
+{
+    if (!config) {
+        return;
+    }
+    m_enabled = true;
+    YamlUtils::ReadYamlVector(config["FirstElement"], m_firstColumns);
+    YamlUtils::ReadYamlVector(config["SecondElement"], m_secondColumns);
+    if (m_firstColumns.size() != 3 || m_secondColumns.size() != 3) {
+        throw std::invalid_argument("PairSelection: FirstElement and SecondElement must list the pt, eta and phi columns");
+    }
+    m_massFirst = config["MassFirst"].as<float>();
+    m_massSecond = config["MassSecond"].as<float>();
+
+    ReadWindow(config["InvariantMass"], m_cuts.useMass, m_cuts.massMin, m_cuts.massMax);
+    ReadWindow(config["Kstar"], m_cuts.useKstar, m_cuts.kstarMin, m_cuts.kstarMax);
+    m_cuts.massSum2 = (m_massFirst + m_massSecond) * (m_massFirst + m_massSecond);
+    m_cuts.massDiff2 = (m_massFirst - m_massSecond) * (m_massFirst - m_massSecond);
+    float angleMin, angleMax;
+    ReadWindow(config["OpeningAngle"], m_cuts.useAngle, angleMin, angleMax);
+    if (m_cuts.useAngle) {
+        m_cuts.cosAngleMin = std::cos(angleMax);
+        m_cuts.cosAngleMax = std::cos(angleMin);
+    }
+    m_kernel = PairKinematics::SelectPairCutKernel(m_cuts);
+}
+
+/**
+ * @brief Optional [min, max] window
+ */
+void PairSelection::ReadWindow(const YAML::Node& node, bool& use, float& min, float& max)
+{
+    use = node ? true : false;
+    if (!use) {
+        return;
+    }
+    if (!node.IsSequence() || node.size() != 2) {
+        throw std::invalid_argument("PairSelection: windows must be given as [min, max]");
+    }
+    min = node[0].as<float>();
+    max = node[1].as<float>();
+}
+
+/**
+ * @brief Input columns needed to compute the four-momenta
+ */
+std::vector<std::string> PairSelection::GetColumnNames() const
+{
+    std::vector<std::string> columnNames(m_firstColumns);
+    columnNames.insert(columnNames.end(), m_secondColumns.begin(), m_secondColumns.end());
+    return columnNames;
+}
+
+std::vector<std::string> PairSelection::GetDerivedColumnNames(const std::string& element)
+{
+    return {"fE" + element, "fPx" + element, "fPy" + element, "fPz" + element};
+}
+
+void PairSelection::AddDerivedColumns(ColumnStore& store) const
+{
+    if (IsEmpty()) {
+        return;
+    }
+    for (const std::string element: {"First", "Second"}) {
+        for (const auto& column: GetDerivedColumnNames(element)) {
+            store.AddDerivedColumn(column, GetLeafType<Float_t>());
+        }
+    }
+}
+
+/**
+ * @brief Resolve the column handles. Handles are valid for every store built with the same dictionary
+ * and derived columns
+ */
+void PairSelection::Resolve(const ColumnStore& store)
+{
+    if (IsEmpty()) {
+        return;
+    }
+    auto resolve = [&] (const std::vector<std::string>& inputColumns, const std::string& element, ElementColumns& columns) {
+        const std::vector<std::string> derivedColumns = GetDerivedColumnNames(element);
+        columns.pt = store.GetColumnHandle<Float_t>(inputColumns[0]);
+        columns.eta = store.GetColumnHandle<Float_t>(inputColumns[1]);
+        columns.phi = store.GetColumnHandle<Float_t>(inputColumns[2]);
+        columns.e = store.GetColumnHandle<Float_t>(derivedColumns[0]);
+        columns.px = store.GetColumnHandle<Float_t>(derivedColumns[1]);
+        columns.py = store.GetColumnHandle<Float_t>(derivedColumns[2]);
+        columns.pz = store.GetColumnHandle<Float_t>(derivedColumns[3]);
+    };
+    resolve(m_firstColumns, "First", m_first);
+    resolve(m_secondColumns, "Second", m_second);
+}
+
+/**
+ * @brief Derived columns to be taken from the second element when mixing
+ */
+std::vector<int> PairSelection::GetSecondDerivedColumns() const
+{
+    if (IsEmpty()) {
+        return {};
+    }
+    return {m_second.e, m_second.px, m_second.py, m_second.pz};
+}
+
+/**
+ * @brief Fill the four-momentum columns of all the rows of the store
+ */
+void PairSelection::ComputeDerived(ColumnStore& store) const
+{
+    if (IsEmpty()) {
+        return;
+    }
+    ComputeDerived(store, m_first, m_massFirst);
+    ComputeDerived(store, m_second, m_massSecond);
+}
+
+void PairSelection::ComputeDerived(ColumnStore& store, const ElementColumns& columns, const float mass) const
+{
+    PairKinematics::ComputeFourMomenta(store.GetData<Float_t>(columns.pt), store.GetData<Float_t>(columns.eta), store.GetData<Float_t>(columns.phi),
+                                       store.GetSize(), mass, store.GetData<Float_t>(columns.e),
+                                       store.GetData<Float_t>(columns.px), store.GetData<Float_t>(columns.py), store.GetData<Float_t>(columns.pz));
+}
+
+FourMomentumArrays PairSelection::GetMomenta(const ColumnStore& store, const ElementColumns& columns) const
+{
+    return {store.GetData<Float_t>(columns.e), store.GetData<Float_t>(columns.px), store.GetData<Float_t>(columns.py), store.GetData<Float_t>(columns.pz)};
+}
+
+/**
+ * @brief Accept mask of the pairs made of the first element of row first and the second element of the rows seconds[i]
+ * @param accept Output, accept[i] = 1 if the i-th pair is selected
+ */
+void PairSelection::Evaluate(const ColumnStore& store, const int first, const int* seconds, const int n, unsigned char* accept) const
+{
+    if (IsEmpty()) {
+        std::fill(accept, accept + n, 1);
+        return;
+    }
+    m_kernel(GetMomenta(store, m_first), first, GetMomenta(store, m_second), seconds, n, m_cuts, accept);
+}
+
+bool PairSelection::IsSelected(const ColumnStore& store, const int first, const int second) const
+{
+    unsigned char accept;
+    Evaluate(store, first, &second, 1, &accept);
+    return accept;
+}
+
+void PairSelection::Print() const
+{
+    std::cout << "Pair selection: ";
+    if (IsEmpty()) {
+        std::cout << "none" << std::endl;
+        return;
+    }
+    std::cout << "masses " << m_massFirst << ", " << m_massSecond;
+    if (m_cuts.useMass) std::cout << "; invariant mass in [" << m_cuts.massMin << ", " << m_cuts.massMax << "]";
+    if (m_cuts.useKstar) std::cout << "; kstar in [" << m_cuts.kstarMin << ", " << m_cuts.kstarMax << "]";
+    if (m_cuts.useAngle) std::cout << "; opening angle in [" << std::acos(m_cuts.cosAngleMax) << ", " << std::acos(m_cuts.cosAngleMin) << "]";
+    std::cout << std::endl;
+}
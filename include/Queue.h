@@ -1,55 +1,83 @@
 #pragma once
 
-#include "TError.h"
-#include <deque>
+#include <vector>
+#include <cassert>
 
+/**
+ * @brief Fixed-capacity FIFO of the last `depth` filled objects, as a ring buffer allocated at construction.
+ * Every object is stored twice (at position p and p + depth), so the elements are always contiguous
+ * from the oldest to the newest one and can be read as a plain array with GetData().
+ * Meant for small trivially copyable objects, e.g. indices of the events in the sorted array
+ */
 template <class T>
 class Queue
 {
     public:
-        Queue() : m_collection(), m_depth(5){};
-        Queue(unsigned int depth) : m_collection()
+        Queue() : Queue(5) {}
+        Queue(unsigned int depth)
         {
-          m_depth = depth;
+          SetDepth(depth);
         }
 
-        void Fill(T &object)
+        void Fill(const T &object)
         {
-          if (IsFull())
+          if (m_depth == 0)
           {
-            m_collection.pop_front();
+            return;
           }
-          m_collection.push_back(object);
-        }
+          unsigned int position = m_first + m_size;
+          if (position >= m_depth)
+          {
+            position -= m_depth;
+          }
+          m_data[position] = object;
+          m_data[position + m_depth] = object;
 
-        T &GetElement(int index)
-        {
-          if (index < 0 || index >= GetSize())
+          if (IsFull())
           {
-            ::Fatal("Queue::GetElement", "index out of range");
-            return m_collection[0];
+            m_first = m_first + 1 == m_depth ? 0 : m_first + 1;
           }
           else
           {
-            return m_collection[index];
+            m_size++;
           }
         }
 
-        int GetSize() { return (int)m_collection.size(); }
+        const T &GetElement(int index) const
+        {
+          assert(index >= 0 && index < GetSize());
+          return m_data[m_first + index];
+        }
+
+        /**
+         * @brief Contiguous elements, from the oldest to the newest (GetSize() elements)
+         */
+        const T *GetData() const { return m_data.data() + m_first; }
+
+        int GetSize() const { return (int)m_size; }
 
         void SetDepth(unsigned int depth)
         {
           m_depth = depth;
-          m_collection.clear();
+          m_data.assign(2 * depth, T());
+          Clear();
+        }
+
+        void Clear()
+        {
+          m_first = 0;
+          m_size = 0;
         }
 
-        int GetDepth() { return (int)m_depth; }
+        int GetDepth() const { return (int)m_depth; }
 
-        bool IsFull() { return m_collection.size() == m_depth; }
+        bool IsFull() const { return m_size == m_depth; }
 
-        bool IsEmpty() { return (int)m_collection.size() == 0; }
+        bool IsEmpty() const { return m_size == 0; }
 
        private:
-        std::deque<T> m_collection;
+        std::vector<T> m_data;                          // ring buffer, mirrored in [m_depth, 2 * m_depth)
         unsigned int m_depth;
+        unsigned int m_first;                           // position of the oldest element
+        unsigned int m_size;
 };
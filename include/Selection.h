@@ -0,0 +1,308 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <set>
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <algorithm>
+
+#include "ColumnStore.h"
+
+/**
+ * @brief Event selection declared as a list of expressions (all of them have to be satisfied), e.g.
+ *      Selection: [ "abs(fNSigmaTPCHad) <= 2", "abs(fNSigmaTPCHe3) <= 2" ]
+ * Supported: numbers, column names, + - * /, comparisons, && || !, parentheses and the functions abs, sqrt, min, max.
+ * The expressions are parsed once into a flat list of nodes (children before parents) and evaluated on the columns
+ * of a ColumnStore in batches: every node is a tight loop over the batch
+ */
+class Selection
+{
+    public:
+        Selection() = default;
+        Selection(const std::vector<std::string>& expressions);
+
+        bool IsEmpty() const { return m_nodes.empty(); }
+        const std::vector<std::string>& GetExpressions() const { return m_expressions; }
+        std::vector<std::string> GetColumnNames() const;
+        void Compile(const ColumnStore& store);
+        void Evaluate(const ColumnStore& store, std::vector<char>& mask) const;
+        void Print() const;
+
+    private:
+        enum NodeType { kConstant, kColumn, kNegate, kNot, kAdd, kSubtract, kMultiply, kDivide,
+                        kLess, kLessEqual, kGreater, kGreaterEqual, kEqual, kNotEqual, kAnd, kOr,
+                        kAbs, kSqrt, kMin, kMax };
+        struct Node
+        {
+            NodeType type;
+            float value;                            // kConstant
+            std::string name;                       // kColumn
+            int column;                             // kColumn, handle in the store
+            int left, right;                        // children (-1 if unused)
+        };
+
+        int AddNode(const NodeType type, const int left = -1, const int right = -1);
+        int ParseOr();
+        int ParseAnd();
+        int ParseComparison();
+        int ParseAdditive();
+        int ParseTerm();
+        int ParseUnary();
+        int ParsePrimary();
+        void SkipSpaces();
+        bool Match(const std::string& token);
+
+        static constexpr size_t kBatchSize = 1024;
+
+        std::vector<std::string> m_expressions;
+        std::vector<Node> m_nodes;                      // children are always stored before their parents
+        std::string m_text;                             // expression being parsed
+        size_t m_position;                              // parser position in m_text
+};
+
+Selection::Selection(const std::vector<std::string>& expressions): m_expressions(expressions), m_position(0)
+{
+    int root = -1;
+    for (const auto& expression: m_expressions) {
+        m_text = expression;
+        m_position = 0;
+        const int node = ParseOr();
+        SkipSpaces();
+        if (m_position != m_text.size()) {
+            throw std::invalid_argument("Selection: unexpected '" + m_text.substr(m_position) + "' in " + expression);
+        }
+        root = root < 0 ? node : AddNode(kAnd, root, node);
+    }
+}
+
+std::vector<std::string> Selection::GetColumnNames() const
+{
+    std::set<std::string> columnNames;
+    for (const auto& node: m_nodes) {
+        if (node.type == kColumn) {
+            columnNames.insert(node.name);
+        }
+    }
+    return std::vector<std::string>(columnNames.begin(), columnNames.end());
+}
+
+/**
+ * @brief Resolve the column names to handles of the store
+ */
+void Selection::Compile(const ColumnStore& store)
+{
+    for (auto& node: m_nodes) {
+        if (node.type == kColumn) {
+            node.column = store.GetColumnIndex(node.name);
+            if (store.GetColumn(node.column).derived) {
+                throw std::invalid_argument("Selection: derived column " + node.name + " is computed after the pre-selection");
+            }
+        }
+    }
+}
+
+/**
+ * @brief Evaluate the selection on all the rows of the store
+ * @param mask Output, 1 for the selected rows. Thread safe
+ */
+void Selection::Evaluate(const ColumnStore& store, std::vector<char>& mask) const
+{
+    const size_t nRows = store.GetSize();
+    mask.assign(nRows, 1);
+    if (IsEmpty()) {
+        return;
+    }
+
+    std::vector<std::vector<float>> buffers(m_nodes.size(), std::vector<float>(kBatchSize));
+    for (size_t first = 0; first < nRows; first += kBatchSize)
+    {
+        const size_t n = std::min(kBatchSize, nRows - first);
+        for (size_t inode = 0; inode < m_nodes.size(); inode++)
+        {
+            const Node& node = m_nodes[inode];
+            float* out = buffers[inode].data();
+            const float* a = node.left >= 0 ? buffers[node.left].data() : nullptr;
+            const float* b = node.right >= 0 ? buffers[node.right].data() : nullptr;
+            switch (node.type) {
+                case kConstant:     std::fill(out, out + n, node.value); break;
+                case kColumn:       store.GetFloats(node.column, first, n, out); break;
+                case kNegate:       for (size_t i = 0; i < n; i++) out[i] = -a[i]; break;
+                case kNot:          for (size_t i = 0; i < n; i++) out[i] = a[i] == 0.f; break;
+                case kAdd:          for (size_t i = 0; i < n; i++) out[i] = a[i] + b[i]; break;
+                case kSubtract:     for (size_t i = 0; i < n; i++) out[i] = a[i] - b[i]; break;
+                case kMultiply:     for (size_t i = 0; i < n; i++) out[i] = a[i] * b[i]; break;
+                case kDivide:       for (size_t i = 0; i < n; i++) out[i] = a[i] / b[i]; break;
+                case kLess:         for (size_t i = 0; i < n; i++) out[i] = a[i] < b[i]; break;
+                case kLessEqual:    for (size_t i = 0; i < n; i++) out[i] = a[i] <= b[i]; break;
+                case kGreater:      for (size_t i = 0; i < n; i++) out[i] = a[i] > b[i]; break;
+                case kGreaterEqual: for (size_t i = 0; i < n; i++) out[i] = a[i] >= b[i]; break;
+                case kEqual:        for (size_t i = 0; i < n; i++) out[i] = a[i] == b[i]; break;
+                case kNotEqual:     for (size_t i = 0; i < n; i++) out[i] = a[i] != b[i]; break;
+                case kAnd:          for (size_t i = 0; i < n; i++) out[i] = (a[i] != 0.f) & (b[i] != 0.f); break;
+                case kOr:           for (size_t i = 0; i < n; i++) out[i] = (a[i] != 0.f) | (b[i] != 0.f); break;
+                case kAbs:          for (size_t i = 0; i < n; i++) out[i] = std::abs(a[i]); break;
+                case kSqrt:         for (size_t i = 0; i < n; i++) out[i] = std::sqrt(a[i]); break;
+                case kMin:          for (size_t i = 0; i < n; i++) out[i] = std::min(a[i], b[i]); break;
+                case kMax:          for (size_t i = 0; i < n; i++) out[i] = std::max(a[i], b[i]); break;
+            }
+        }
+
+        const float* result = buffers.back().data();
+        for (size_t i = 0; i < n; i++) {
+            mask[first + i] = result[i] != 0.f;
+        }
+    }
+}
+
+void Selection::Print() const
+{
+    std::cout << "Selection: ";
+    if (IsEmpty()) {
+        std::cout << "none";
+    }
+    for (size_t iexpression = 0; iexpression < m_expressions.size(); iexpression++) {
+        std::cout << (iexpression > 0 ? " && " : "") << "(" << m_expressions[iexpression] << ")";
+    }
+    std::cout << std::endl;
+}
+
+int Selection::AddNode(const NodeType type, const int left, const int right)
+{
+    m_nodes.push_back({type, 0.f, "", -1, left, right});
+    return (int)m_nodes.size() - 1;
+}
+
+void Selection::SkipSpaces()
+{
+    while (m_position < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_position]))) {
+        m_position++;
+    }
+}
+
+/**
+ * @brief Consume the token if it is the next one in the expression
+ */
+bool Selection::Match(const std::string& token)
+{
+    SkipSpaces();
+    if (m_text.compare(m_position, token.size(), token) == 0) {
+        m_position += token.size();
+        return true;
+    }
+    return false;
+}
+
+int Selection::ParseOr()
+{
+    int node = ParseAnd();
+    while (Match("||")) {
+        node = AddNode(kOr, node, ParseAnd());
+    }
+    return node;
+}
+
+int Selection::ParseAnd()
+{
+    int node = ParseComparison();
+    while (Match("&&")) {
+        node = AddNode(kAnd, node, ParseComparison());
+    }
+    return node;
+}
+
+int Selection::ParseComparison()
+{
+    int node = ParseAdditive();
+    // two-character operators first
+    if (Match("<="))        node = AddNode(kLessEqual, node, ParseAdditive());
+    else if (Match(">="))   node = AddNode(kGreaterEqual, node, ParseAdditive());
+    else if (Match("=="))   node = AddNode(kEqual, node, ParseAdditive());
+    else if (Match("!="))   node = AddNode(kNotEqual, node, ParseAdditive());
+    else if (Match("<"))    node = AddNode(kLess, node, ParseAdditive());
+    else if (Match(">"))    node = AddNode(kGreater, node, ParseAdditive());
+    return node;
+}
+
+int Selection::ParseAdditive()
+{
+    int node = ParseTerm();
+    while (true) {
+        if (Match("+"))         node = AddNode(kAdd, node, ParseTerm());
+        else if (Match("-"))    node = AddNode(kSubtract, node, ParseTerm());
+        else                    return node;
+    }
+}
+
+int Selection::ParseTerm()
+{
+    int node = ParseUnary();
+    while (true) {
+        if (Match("*"))         node = AddNode(kMultiply, node, ParseUnary());
+        else if (Match("/"))    node = AddNode(kDivide, node, ParseUnary());
+        else                    return node;
+    }
+}
+
+int Selection::ParseUnary()
+{
+    if (Match("-")) {
+        return AddNode(kNegate, ParseUnary());
+    }
+    if (m_text.compare(m_position, 2, "!=") != 0 && Match("!")) {
+        return AddNode(kNot, ParseUnary());
+    }
+    return ParsePrimary();
+}
+
+int Selection::ParsePrimary()
+{
+    SkipSpaces();
+    if (Match("(")) {
+        const int node = ParseOr();
+        if (!Match(")")) {
+            throw std::invalid_argument("Selection: missing ')' in " + m_text);
+        }
+        return node;
+    }
+
+    if (m_position < m_text.size() && (std::isdigit(static_cast<unsigned char>(m_text[m_position])) || m_text[m_position] == '.')) {
+        const char* start = m_text.c_str() + m_position;
+        char* end = nullptr;
+        const float value = std::strtof(start, &end);
+        m_position += end - start;
+        const int node = AddNode(kConstant);
+        m_nodes[node].value = value;
+        return node;
+    }
+
+    std::string name;
+    while (m_position < m_text.size() && (std::isalnum(static_cast<unsigned char>(m_text[m_position])) || m_text[m_position] == '_')) {
+        name += m_text[m_position++];
+    }
+    if (name.empty() && m_position == m_text.size()) {
+        throw std::invalid_argument("Selection: unexpected end of " + m_text);
+    }
+    if (name.empty()) {
+        throw std::invalid_argument("Selection: unexpected '" + m_text.substr(m_position) + "' in " + m_text);
+    }
+
+    if (Match("(")) {
+        const int first = ParseOr();
+        const int second = Match(",") ? ParseOr() : -1;
+        if (!Match(")")) {
+            throw std::invalid_argument("Selection: missing ')' after the arguments of " + name + " in " + m_text);
+        }
+        if (name == "abs" && second < 0)        return AddNode(kAbs, first);
+        if (name == "sqrt" && second < 0)       return AddNode(kSqrt, first);
+        if (name == "min" && second >= 0)       return AddNode(kMin, first, second);
+        if (name == "max" && second >= 0)       return AddNode(kMax, first, second);
+        throw std::invalid_argument("Selection: unknown function " + name + " in " + m_text);
+    }
+
+    const int node = AddNode(kColumn);
+    m_nodes[node].name = name;
+    return node;
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ColumnStore.h"
+
+/**
+ * @brief Uncompressed columnar cache of the sorted events, written after Sorting and memory-mapped by the reruns.
+ * Layout (native endianness):
+ *      magic "EMSORT01" | key size, key | number of columns, then name size, name, type, derived flag of each column |
+ *      number of rows | number of bins, first row of each bin | padding | values of each column, 64-byte aligned
+ * The key describes the inputs and the configuration the sorted events depend on: a cache with another key,
+ * or with other columns, is not used
+ */
+class SortedCache
+{
+    public:
+        static void Write(const std::string& fileName, const std::string& key, const ColumnStore& store, const std::vector<int>& binIndex);
+        static bool Read(const std::string& fileName, const std::string& key, ColumnStore& store, std::vector<int>& binIndex);
+
+    private:
+        static constexpr char kMagic[9] = "EMSORT01";
+        static constexpr size_t kAlignment = 64;
+        static size_t Align(const size_t offset) { return (offset + kAlignment - 1) / kAlignment * kAlignment; }
+};
+
+/**
+ * @brief Write the cache to a temporary file, then rename it: an interrupted run does not leave a truncated cache
+ */
+void SortedCache::Write(const std::string& fileName, const std::string& key, const ColumnStore& store, const std::vector<int>& binIndex)
+{
+    const std::string tmpFileName = fileName + ".tmp";
+    std::ofstream out(tmpFileName, std::ios::binary | std::ios::trunc);
+    auto writeValue = [&out] (const uint64_t value) { out.write(reinterpret_cast<const char*>(&value), sizeof(value)); };
+
+    out.write(kMagic, 8);
+    writeValue(key.size());
+    out.write(key.data(), key.size());
+    writeValue(store.GetNColumns());
+    for (int icolumn = 0; icolumn < store.GetNColumns(); icolumn++) {
+        const Column& column = store.GetColumn(icolumn);
+        writeValue(column.name.size());
+        out.write(column.name.data(), column.name.size());
+        out.put(column.type);
+        out.put(column.derived ? 1 : 0);
+    }
+    writeValue(store.GetSize());
+    writeValue(binIndex.size());
+    for (const int index: binIndex) {
+        writeValue(index);
+    }
+
+    for (int icolumn = 0; icolumn < store.GetNColumns(); icolumn++) {
+        const Column& column = store.GetColumn(icolumn);
+        const size_t position = out.tellp();
+        for (size_t ipad = position; ipad < Align(position); ipad++) {
+            out.put(0);
+        }
+        out.write(column.data.data(), store.GetSize() * column.elementSize);
+    }
+    out.close();
+    if (!out || std::rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+        std::remove(tmpFileName.c_str());
+        throw std::runtime_error("SortedCache: cannot write " + fileName);
+    }
+    std::cout << "Sorted events cached in " << fileName << std::endl;
+}
+
+/**
+ * @brief Map the cache and fill the store (initialized with the same columns) and the bin index.
+ * The column arrays are copied from the mapping as they are, with no decoding
+ * @return false if the file is missing, truncated or corrupt, or was written for another key or with other columns
+ */
+bool SortedCache::Read(const std::string& fileName, const std::string& key, ColumnStore& store, std::vector<int>& binIndex)
+{
+    const int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat fileStat;
+    if (fstat(fd, &fileStat) != 0 || fileStat.st_size < 8) {
+        close(fd);
+        return false;
+    }
+    const size_t fileSize = fileStat.st_size;
+    void* mapping = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    // advice values are not flags, one call each
+    madvise(mapping, fileSize, MADV_SEQUENTIAL);
+    madvise(mapping, fileSize, MADV_WILLNEED);
+    const char* data = static_cast<const char*>(mapping);
+
+    size_t position = 0;
+    bool valid = true;
+    auto readBytes = [&] (const size_t size) -> const char* {
+        valid &= position + size <= fileSize;
+        const char* bytes = valid ? data + position : nullptr;
+        position += size;
+        return bytes;
+    };
+    auto readValue = [&] () -> uint64_t {
+        uint64_t value = 0;
+        if (const char* bytes = readBytes(sizeof(value))) {
+            std::memcpy(&value, bytes, sizeof(value));
+        }
+        return value;
+    };
+
+    valid = std::memcmp(readBytes(8), kMagic, 8) == 0;
+    const uint64_t keySize = valid ? readValue() : 0;
+    const char* keyBytes = readBytes(keySize);
+    valid = valid && std::string(keyBytes, keySize) == key;
+    valid = valid && readValue() == static_cast<uint64_t>(store.GetNColumns());
+    for (int icolumn = 0; valid && icolumn < store.GetNColumns(); icolumn++) {
+        const Column& column = store.GetColumn(icolumn);
+        const uint64_t nameSize = readValue();
+        const char* name = readBytes(nameSize);
+        const char* flags = readBytes(2);
+        valid = valid && std::string(name, nameSize) == column.name && flags[0] == column.type && (flags[1] != 0) == column.derived;
+    }
+    const uint64_t nRows = valid ? readValue() : 0;
+    const uint64_t nBins = valid ? readValue() : 0;
+    valid = valid && nRows <= fileSize && nBins <= (fileSize - std::min(position, fileSize)) / sizeof(uint64_t);
+    std::vector<int> index(valid ? nBins : 0);
+    for (auto& value: index) {
+        value = static_cast<int>(readValue());
+    }
+    // the bins are ranges of rows: a corrupt index would make the mixing read out of the columns
+    valid = valid && (index.empty() || index.front() == 0) && std::is_sorted(index.begin(), index.end()) &&
+            (index.empty() || static_cast<uint64_t>(index.back()) <= nRows);
+    std::vector<const char*> columns(store.GetNColumns());
+    for (int icolumn = 0; valid && icolumn < store.GetNColumns(); icolumn++) {
+        position = Align(position);
+        columns[icolumn] = readBytes(nRows * store.GetColumn(icolumn).elementSize);
+    }
+
+    if (valid) {
+        store.Assign(columns, nRows);
+        binIndex = std::move(index);
+    } else {
+        std::cout << "Sorted cache " << fileName << " does not match the configuration or is corrupt, not used" << std::endl;
+    }
+    munmap(mapping, fileSize);
+    return valid;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstdio>
+
+#include <yaml-cpp/yaml.h>
+
+/**
+ * @brief Content hashes of the stages of the pipeline. The output of a stage is reused when the hash of everything it
+ * depends on (a subset of the YAML configuration, the input files, the hash of the previous stage) is the one
+ * recorded next to the output when it was produced.
+ */
+namespace StageCache {
+
+    /**
+     * @brief 64-bit FNV-1a hash of a string, in hexadecimal.
+     */
+    std::string Hash(const std::string& content) {
+        uint64_t hash = 14695981039346656037ull;
+        for (const char c : content) {
+            hash ^= static_cast<unsigned char>(c);
+            hash *= 1099511628211ull;
+        }
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+        return hex;
+    }
+
+    /**
+     * @brief Hash of the given keys of the configuration (missing keys included) and of extra content, e.g. the inputs.
+     */
+    std::string HashConfig(const YAML::Node& config, const std::vector<std::string>& keys, const std::string& extra = "") {
+        std::string content = extra;
+        for (const auto & key : keys) {
+            const YAML::Node node = config[key];
+            content += "\n" + key + ": " + (node ? YAML::Dump(node) : std::string("~"));
+        }
+        return Hash(content);
+    }
+
+    std::string GetHashFileName(const std::string& outputFileName) {
+        return outputFileName + ".hash";
+    }
+
+    /**
+     * @brief The output exists and was produced from inputs with the given hash.
+     */
+    bool IsUpToDate(const std::string& outputFileName, const std::string& hash) {
+        std::ifstream output(outputFileName);
+        std::ifstream hashFile(GetHashFileName(outputFileName));
+        std::string recordedHash;
+        return output.good() && hashFile >> recordedHash && recordedHash == hash;
+    }
+
+    /**
+     * @brief Record the hash of the inputs of an output just produced.
+     */
+    void Record(const std::string& outputFileName, const std::string& hash) {
+        std::ofstream hashFile(GetHashFileName(outputFileName), std::ios::trunc);
+        hashFile << hash << std::endl;
+    }
+
+    /**
+     * @brief Forget the hash of an output about to be rewritten, so that an interrupted stage is not reused.
+     */
+    void Invalidate(const std::string& outputFileName) {
+        std::remove(GetHashFileName(outputFileName).c_str());
+    }
+}
@@ -7,6 +7,13 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <stdexcept>
+#include <atomic>
+#include <future>
+#include <algorithm>
+
+#include <glob.h>
+#include <sys/stat.h>
 
 #include <yaml-cpp/yaml.h>
 
@@ -16,9 +23,130 @@
 #include <TDirectory.h>
 #include <TList.h>
 #include <TString.h>
+#include <TROOT.h>
 
 #include "TreeReader.h"
 #include "Row.h"
+#include "ColumnStore.h"
+#include "YamlUtils.h"
+
+/**
+ * Expand the input files of a dataset: a single path or glob pattern, or a list of them. 
+ * Paths without wildcards (e.g. remote files) are kept as they are.
+ * 
+ * @return The files, sorted by name within each pattern.
+ */
+std::vector<std::string> ExpandInputFiles(const YAML::Node& node) {
+    
+    std::vector<std::string> patterns;
+    if (node.IsSequence()) {
+        YamlUtils::ReadYamlVector(node, patterns);
+    } else {
+        patterns.push_back(node.as<std::string>());
+    }
+
+    std::vector<std::string> fileNames;
+    for (const auto & pattern : patterns) {
+        glob_t globResult;
+        const int status = glob(pattern.c_str(), GLOB_NOCHECK, nullptr, &globResult);
+        if (status != 0) {
+            globfree(&globResult);
+            throw std::runtime_error("Cannot expand input files: " + pattern);
+        }
+        for (size_t ipath = 0; ipath < globResult.gl_pathc; ++ipath) {
+            fileNames.push_back(globResult.gl_pathv[ipath]);
+        }
+        globfree(&globResult);
+    }
+    if (fileNames.empty()) {
+        throw std::runtime_error("No input file");
+    }
+    return fileNames;
+}
+
+/**
+ * Identify the input files by name, size and modification time (only by name if they are not local).
+ */
+std::string DescribeInputFiles(const std::vector<std::string>& fileNames) {
+    
+    std::string description;
+    for (const auto & fileName : fileNames) {
+        struct stat fileStat;
+        description += fileName;
+        if (stat(fileName.c_str(), &fileStat) == 0) {
+            description += ":" + std::to_string(fileStat.st_size) + ":" + std::to_string(fileStat.st_mtime);
+        }
+        description += ";";
+    }
+    return description;
+}
+
+/**
+ * A DF directory of one of the input files.
+ */
+struct InputDirectory {
+    std::string fileName;
+    std::string directoryName;
+};
+
+/**
+ * Enumerate the directories of the input files, without reading them.
+ * 
+ * @return The directories, in file and key order.
+ */
+std::vector<InputDirectory> ListDirectories(const std::vector<std::string>& fileNames) {
+    
+    std::vector<InputDirectory> directories;
+    for (const auto & fileName : fileNames) {
+        TFile * inputFile = TFile::Open(fileName.c_str(), "READ");
+        if (!inputFile || inputFile->IsZombie()) {
+            throw std::runtime_error("Cannot open input file: " + fileName);
+        }
+        TIter nextDir(inputFile->GetListOfKeys());
+        TKey *key;
+        while ((key = (TKey*)nextDir())) {
+            if (std::string(key->GetClassName()) == "TDirectoryFile") {
+                directories.push_back({fileName, key->GetName()});
+            } else {
+                std::cerr << "Skipping " << key->GetName() << " in " << fileName << ": not a directory" << std::endl;
+            }
+        }
+        inputFile->Close();
+    }
+    return directories;
+}
+
+/**
+ * Handle to one input file at a time, reopened when a directory of another file is requested.
+ * Each worker has its own, TFile objects cannot be shared between reading threads.
+ */
+class InputFileHandle {
+    public:
+        InputFileHandle() = default;
+        InputFileHandle(const InputFileHandle& other) = delete;
+        InputFileHandle& operator=(const InputFileHandle& other) = delete;
+        ~InputFileHandle() { Close(); }
+
+        TFile * Get(const std::string& fileName) {
+            if (!m_file || fileName != m_fileName) {
+                Close();
+                m_file = TFile::Open(fileName.c_str(), "READ");
+                m_fileName = fileName;
+            }
+            return m_file;
+        }
+        void Close() {
+            if (m_file) {
+                m_file->Close();
+                delete m_file;
+                m_file = nullptr;
+            }
+        }
+
+    private:
+        TFile * m_file = nullptr;
+        std::string m_fileName;
+};
 
 /**
  * Loops over the directories in a TFile and merges all the TTrees with the given name.
@@ -74,6 +202,142 @@ void MergeAllTrees(const char* inputFileName, std::vector<std::string>& treeName
     outputFile->Close();
 }
 
+/**
+ * Position of the DF directories in the trees merged by ParallelMergeAllTrees:
+ * the entries of directory i are [entryOffsets[itree][i], entryOffsets[itree][i+1]) of tree itree.
+ */
+struct MergeIndex {
+    std::vector<InputDirectory> directories;
+    std::vector<std::vector<Long64_t>> entryOffsets;
+};
+
+/**
+ * Read the requested columns of the trees of a directory into columnar buffers.
+ * The trees are joined row by row later on, so a missing tree or trees with different number of entries are an error.
+ * 
+ * @param treeArrays Output, one store per tree.
+ */
+void ReadDirectoryTrees(TFile * inputFile, const std::string& directoryName, const std::vector<std::string>& treeNames, 
+                        const std::vector<std::vector<std::string>>& columnDicts, std::vector<ColumnStore>& treeArrays) {
+    
+    for (size_t itree = 0; itree < treeNames.size(); ++itree) {
+        ColumnStore& treeArray = treeArrays[itree];
+        treeArray.InitFromDict(columnDicts[itree]);
+        TTree * tree = (TTree*)inputFile->Get((directoryName + "/" + treeNames[itree]).c_str());
+        if (!tree) {
+            throw std::runtime_error("Missing tree " + treeNames[itree] + " in directory " + directoryName);
+        }
+        if (itree > 0 && tree->GetEntries() != (Long64_t)treeArrays.front().GetSize()) {
+            throw std::runtime_error("Trees with different number of entries in directory " + directoryName);
+        }
+        tree->SetBranchStatus("*", false);
+        for (const auto & column : treeArray.GetColumnNames()) {
+            tree->SetBranchStatus(column.c_str(), true);
+        }
+        treeArray.SetBranchAddresses(tree);
+        const Long64_t nEntries = tree->GetEntries();
+        treeArray.Reserve(nEntries);
+        for (Long64_t ientry = 0; ientry < nEntries; ++ientry) {
+            tree->GetEntry(ientry);
+            treeArray.PushStaged();
+        }
+        delete tree; // not needed anymore, do not keep one tree per directory in memory
+    }
+}
+
+/**
+ * Merge all the trees with the given names of the directories of the input files, reading the directories in parallel.
+ * The directories are enumerated once. nThreads workers, each with its own handle to the input files, read the 
+ * requested columns of the trees of a window of directories. The windows are written to the output trees in file and
+ * directory order, so for a single file the entries are the same as for MergeAllTrees. The directories and the entry
+ * offsets are written to the output file ("DirectoryFileNames", "DirectoryNames" and "<treeName>EntryOffsets").
+ * 
+ * @param inputFileNames The input files, see ExpandInputFiles.
+ * @param columnDicts The columns to read of each tree, in the format "branchName/type".
+ * 
+ * @return The entry offsets of the directories in the merged trees.
+ */
+MergeIndex ParallelMergeAllTrees(const std::vector<std::string>& inputFileNames, const std::vector<std::string>& treeNames, 
+                                 const std::vector<std::vector<std::string>>& columnDicts, const char* outputFileName, const int nThreads) {
+    
+    const size_t nTrees = treeNames.size();
+    MergeIndex mergeIndex;
+    mergeIndex.entryOffsets.assign(nTrees, std::vector<Long64_t>(1, 0));
+
+    mergeIndex.directories = ListDirectories(inputFileNames);
+    const size_t nDirectories = mergeIndex.directories.size();
+    const int nWorkers = std::max(1, std::min(nThreads, (int)nDirectories));
+    std::cout << "Merging " << nTrees << " trees of " << nDirectories << " directories in " << inputFileNames.size() 
+              << " files with " << nWorkers << " threads" << std::endl;
+
+    ROOT::EnableThreadSafety();
+    std::vector<InputFileHandle> workerFiles(nWorkers);
+
+    TFile * outputFile = TFile::Open(outputFileName, "RECREATE");
+    outputFile->cd();
+    std::vector<TTree *> outputTrees(nTrees);
+    std::vector<ColumnStore> outputArrays(nTrees);
+    for (size_t itree = 0; itree < nTrees; ++itree) {
+        outputTrees[itree] = new TTree(treeNames[itree].c_str(), treeNames[itree].c_str());
+        outputArrays[itree].InitFromDict(columnDicts[itree]);
+        outputArrays[itree].CreateBranches(outputTrees[itree]);
+    }
+
+    // at most windowSize directories in memory at a time
+    const size_t windowSize = 4 * nWorkers;
+    for (size_t windowStart = 0; windowStart < nDirectories; windowStart += windowSize) {
+        const size_t windowEnd = std::min(nDirectories, windowStart + windowSize);
+        std::vector<std::vector<ColumnStore>> directoryArrays(windowEnd - windowStart, std::vector<ColumnStore>(nTrees));
+        std::atomic<size_t> nextDirectory(windowStart);
+        std::vector<std::future<void>> futures;
+        for (int iworker = 0; iworker < nWorkers; ++iworker) {
+            futures.push_back(std::async(std::launch::async, [&, iworker] () {
+                for (size_t idir = nextDirectory++; idir < windowEnd; idir = nextDirectory++) {
+                    const InputDirectory& directory = mergeIndex.directories[idir];
+                    ReadDirectoryTrees(workerFiles[iworker].Get(directory.fileName), directory.directoryName, treeNames, columnDicts, 
+                                       directoryArrays[idir - windowStart]);
+                }
+            }));
+        }
+        for (auto & future : futures) {
+            future.get();
+        }
+
+        for (size_t itree = 0; itree < nTrees; ++itree) {
+            for (auto & treeArrays : directoryArrays) {
+                ColumnStore& outputArray = outputArrays[itree];
+                outputArray.Append(treeArrays[itree]);
+                for (size_t ientry = 0; ientry < outputArray.GetSize(); ++ientry) {
+                    outputArray.LoadStaged(ientry);
+                    outputTrees[itree]->Fill();
+                }
+                mergeIndex.entryOffsets[itree].push_back(mergeIndex.entryOffsets[itree].back() + outputArray.GetSize());
+                outputArray.Clear();
+                treeArrays[itree].Clear();
+            }
+        }
+    }
+    for (auto & workerFile : workerFiles) {
+        workerFile.Close();
+    }
+
+    outputFile->cd();
+    for (size_t itree = 0; itree < nTrees; ++itree) {
+        outputTrees[itree]->Write();
+        outputFile->WriteObject(&mergeIndex.entryOffsets[itree], (treeNames[itree] + "EntryOffsets").c_str());
+    }
+    std::vector<std::string> directoryFileNames, directoryNames;
+    for (const auto & directory : mergeIndex.directories) {
+        directoryFileNames.push_back(directory.fileName);
+        directoryNames.push_back(directory.directoryName);
+    }
+    outputFile->WriteObject(&directoryFileNames, "DirectoryFileNames");
+    outputFile->WriteObject(&directoryNames, "DirectoryNames");
+    std::cout << "Merging done" << std::endl;
+    outputFile->Close();
+    return mergeIndex;
+}
+
 /**
  * Merge the trees horizontally by adding the columns of the trees.
 */
@@ -129,3 +393,32 @@ void HorizontalMerge(const char* inputFileName, std::vector<std::string>& treeNa
     inputFile->Close();
     outputFile->Close();
 }
+
+/**
+ * Join the trees along the horizontal axis without writing a merged tree: the other trees are attached as friends
+ * of the first one, which then exposes the columns of all of them. The trees must have the same entries.
+ * 
+ * @param inputFile The file with the (vertically merged) trees.
+ * @param treeNames The names of the trees to join.
+ * 
+ * @return The first tree, with the other ones as friends.
+ */
+TTree * FriendJoin(TFile * inputFile, const std::vector<std::string>& treeNames) {
+    
+    TTree * mainTree = nullptr;
+    for (const auto & treeName : treeNames) {
+        TTree * tree = (TTree*)inputFile->Get(treeName.c_str());
+        if (!tree) {
+            throw std::runtime_error("Missing tree " + treeName + " in " + inputFile->GetName());
+        }
+        if (!mainTree) {
+            mainTree = tree;
+            continue;
+        }
+        if (tree->GetEntries() != mainTree->GetEntries()) {
+            throw std::runtime_error("Tree " + treeName + " has a different number of entries than " + mainTree->GetName());
+        }
+        mainTree->AddFriend(tree);
+    }
+    return mainTree;
+}